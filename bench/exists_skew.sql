@@ -0,0 +1,5 @@
+\set customer random(1, 1000)
+SELECT d.id FROM bench_document d
+ WHERE d.customer_id = :customer
+   AND EXISTS (SELECT 1 FROM bench_tag t WHERE t.document_id = d.id AND t.tag = 3)
+ ORDER BY d.created DESC LIMIT 20;
@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Benchmark of magicplan on every PostgreSQL major version it is packaged
+# for, to compare the planning overhead and the wins across versions.
+#
+# For each version of debian/pgversions (or BENCH_VERSIONS), magicplan is
+# built and installed with the pg_config of that version, a temporary
+# cluster is created with magicplan in shared_preload_libraries, and
+# bench/run.sh runs against it. The BENCH_* settings of run.sh apply.
+#
+# The results are printed as JSON lines, one object per row of the run.sh
+# tables, with the version and the table added: "runs" for the latency,
+# planning overhead and win rate of each script and mode, "speedups" for the
+# planned and actual speedups of the EXISTS-skew query. Empty values are
+# null.
+#
+# Each version is looked for in BENCH_PG_ROOT/<version>/bin (default
+# /usr/lib/postgresql, the Debian layout), and skipped if it is missing.
+# Installing needs write access to the PostgreSQL directories, BENCH_INSTALL=no
+# skips it when the postgresql-<version>-magicplan packages are installed.
+# The clusters listen on a socket only, on port BENCH_PORT (default 5499).
+#
+set -e
+
+dir=$(dirname "$0")
+top="$dir/.."
+root=${BENCH_PG_ROOT:-/usr/lib/postgresql}
+versions=${BENCH_VERSIONS:-$(cat "$top/debian/pgversions")}
+port=${BENCH_PORT:-5499}
+tmp=$(mktemp -d)
+cluster=""
+
+stop_cluster() {
+	if [ -n "$cluster" ]; then
+		"$bin/pg_ctl" -D "$cluster" -m fast -w stop >/dev/null
+		cluster=""
+	fi
+}
+trap 'stop_cluster; rm -rf "$tmp"' EXIT
+
+# Turn the tables of run.sh, separated by an empty line, into JSON lines
+to_json() {
+	awk -F '\t' -v version="$1" '
+		BEGIN { table = "runs"; ncolumns = 0 }
+		NF == 0 { table = "speedups"; ncolumns = 0; next }
+		ncolumns == 0 {
+			for (i = 1; i <= NF; i++)
+				column[i] = $i
+			ncolumns = NF
+			next
+		}
+		{
+			line = "{\"version\": \"" version "\", \"table\": \"" table "\""
+			for (i = 1; i <= ncolumns; i++) {
+				if ($i == "")
+					value = "null"
+				else if ($i ~ /^-?[0-9]+(\.[0-9]+)?$/)
+					value = $i
+				else
+					value = "\"" $i "\""
+				line = line ", \"" column[i] "\": " value
+			}
+			print line "}"
+		}'
+}
+
+for version in $versions; do
+	bin="$root/$version/bin"
+	if [ ! -x "$bin/pg_config" ] || [ ! -x "$bin/initdb" ]; then
+		echo "PostgreSQL $version not found in $root/$version, skipped" >&2
+		continue
+	fi
+
+	if [ "${BENCH_INSTALL:-yes}" != no ]; then
+		echo "Building magicplan for PostgreSQL $version..." >&2
+		${MAKE:-make} -C "$top" PG_CONFIG="$bin/pg_config" clean install >&2
+	fi
+
+	echo "Starting a PostgreSQL $version cluster..." >&2
+	"$bin/initdb" -D "$tmp/$version" -A trust -U magicplan_bench >/dev/null
+	"$bin/pg_ctl" -D "$tmp/$version" -l "$tmp/$version.log" -w \
+		-o "-p $port -k $tmp -c listen_addresses='' -c shared_preload_libraries=magicplan" \
+		start >/dev/null
+	cluster="$tmp/$version"
+
+	export PGHOST="$tmp" PGPORT="$port" PGUSER=magicplan_bench PGDATABASE=postgres
+	"$bin/psql" -X -q -v ON_ERROR_STOP=1 -c "CREATE EXTENSION magicplan"
+	PATH="$bin:$PATH" sh "$dir/run.sh" >"$tmp/$version.tsv"
+	stop_cluster
+
+	to_json "$version" <"$tmp/$version.tsv"
+done
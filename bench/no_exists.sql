@@ -0,0 +1,4 @@
+\set customer random(1, 1000)
+SELECT d.id FROM bench_document d
+ WHERE d.customer_id = :customer
+ ORDER BY d.created DESC LIMIT 20;
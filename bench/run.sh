@@ -0,0 +1,84 @@
+#!/bin/sh
+#
+# Benchmark of magicplan: planning overhead and plan wins.
+#
+# Each pgbench script of this directory is run with magicplan disabled
+# (off), enabled with its decision cache (on), and searching at every
+# planning (search, magicplan.sample_rate = 1). For each run, the average
+# latency is reported, along with the extra planning time per candidate and
+# per planner call, and the share of the searches that used an OFFSET 0,
+# from pg_stat_magicplan. Then, for a large and a small customer of the
+# EXISTS-skew query, the speedup expected from the costs is compared with
+# the one measured by EXPLAIN ANALYZE.
+#
+# magicplan must be in shared_preload_libraries, and the extension created
+# in the target database. Connection settings are taken from the usual PG*
+# environment variables, and the duration of each run, the number of
+# clients and the scale of the schema from BENCH_DURATION (default 30s),
+# BENCH_CLIENTS (default 4) and BENCH_SCALE (default 10, that is a million
+# documents).
+#
+set -e
+
+dir=$(dirname "$0")
+duration=${BENCH_DURATION:-30}
+clients=${BENCH_CLIENTS:-4}
+scale=${BENCH_SCALE:-10}
+PSQL="psql -X -q -v ON_ERROR_STOP=1"
+
+if ! $PSQL -At -c "SELECT magicplan_stats_reset()" >/dev/null 2>&1; then
+	echo "magicplan must be in shared_preload_libraries and created in the database" >&2
+	exit 1
+fi
+
+echo "Loading the schema (scale $scale)..." >&2
+$PSQL -v scale="$scale" -f "$dir/schema.sql"
+
+mode_options() {
+	case $1 in
+		off) echo "-c magicplan.enabled=off" ;;
+		on) echo "-c magicplan.enabled=on" ;;
+		search) echo "-c magicplan.enabled=on -c magicplan.sample_rate=1" ;;
+	esac
+}
+
+printf "script\tmode\tlatency_ms\ttps\textra_ms_per_candidate\textra_ms_per_call\twin_rate\n"
+for script in exists_skew no_exists; do
+	for mode in off on search; do
+		$PSQL -At -c "SELECT magicplan_stats_reset()" >/dev/null
+		output=$(PGOPTIONS="$(mode_options $mode)" \
+			pgbench -n -M simple -T "$duration" -c "$clients" -f "$dir/$script.sql")
+		latency=$(echo "$output" | sed -n 's/^latency average = \([0-9.]*\) ms$/\1/p')
+		tps=$(echo "$output" | sed -n 's/^tps = \([0-9.]*\) .*$/\1/p' | head -n 1)
+		stats=$($PSQL -At -F "$(printf '\t')" -c "SELECT coalesce(round((sum(total_extra_time) / nullif(sum(candidates), 0))::numeric, 4)::text, ''),
+			coalesce(round((sum(total_extra_time) / nullif(sum(calls), 0))::numeric, 4)::text, ''),
+			coalesce(round((sum(wins)::numeric / nullif(sum(searches), 0)), 4)::text, '')
+			FROM pg_stat_magicplan")
+		printf "%s\t%s\t%s\t%s\t%s\n" "$script" "$mode" "$latency" "$tps" "$stats"
+	done
+done
+
+# Planned and actual speedups. The search mode is used so that EXPLAIN shows
+# the pristine and chosen costs.
+explain() {
+	PGOPTIONS="$(mode_options $1)" $PSQL -At -c "EXPLAIN ANALYZE SELECT d.id FROM bench_document d
+		 WHERE d.customer_id = $2
+		   AND EXISTS (SELECT 1 FROM bench_tag t WHERE t.document_id = d.id AND t.tag = 3)
+		 ORDER BY d.created DESC LIMIT 20"
+}
+
+echo
+printf "customer\tpristine_cost\tchosen_cost\tplanned_speedup\tpristine_ms\tchosen_ms\tactual_speedup\n"
+for customer in 1 500; do
+	pristine=$(explain off $customer)
+	chosen=$(explain search $customer)
+	printf "%s\n%s\n" "$pristine" "$chosen" | awk -v customer=$customer '
+		/Execution [Tt]ime:/ { time[n++] = $(NF - 1) }
+		/Pristine Cost:/ { pristine_cost = $NF }
+		/Chosen Cost:/ { chosen_cost = $NF }
+		END {
+			printf "%s\t%s\t%s\t%.2f\t%s\t%s\t%.2f\n", customer, pristine_cost, chosen_cost,
+				chosen_cost > 0 ? pristine_cost / chosen_cost : 0,
+				time[0], time[1], time[1] > 0 ? time[0] / time[1] : 0
+		}'
+done
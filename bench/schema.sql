@@ -0,0 +1,29 @@
+--
+-- Schema for the magicplan benchmark, see run.sh
+--
+-- Documents belong to customers, with a heavy skew: customer 1 owns half of
+-- them, the others share the rest. Looking for the latest documents of a
+-- customer with a given tag is the case from the README: for customer 1,
+-- walking its documents and checking the tags one by one (EXISTS with an
+-- OFFSET 0) finds 20 of them quickly, while for the small customers joining
+-- the tags is cheaper.
+--
+DROP TABLE IF EXISTS bench_tag, bench_document, bench_customer;
+
+CREATE TABLE bench_customer (id int PRIMARY KEY, name text NOT NULL);
+CREATE TABLE bench_document (id int PRIMARY KEY, customer_id int NOT NULL, created timestamptz NOT NULL);
+CREATE TABLE bench_tag (document_id int NOT NULL, tag int NOT NULL);
+
+INSERT INTO bench_customer SELECT i, 'customer ' || i FROM generate_series(1, 1000) i;
+INSERT INTO bench_document
+SELECT i, CASE WHEN i % 2 = 0 THEN 1 ELSE 2 + i % 999 END, now() - i * interval '1 minute'
+FROM generate_series(1, :scale * 100000) i;
+INSERT INTO bench_tag SELECT id, id % 20 FROM bench_document;
+INSERT INTO bench_tag SELECT id, 100 + id % 7 FROM bench_document WHERE id % 3 = 0;
+
+CREATE INDEX ON bench_document (customer_id, created);
+CREATE INDEX ON bench_tag (document_id);
+CREATE INDEX ON bench_tag (tag);
+ANALYZE bench_customer;
+ANALYZE bench_document;
+ANALYZE bench_tag;
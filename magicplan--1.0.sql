@@ -0,0 +1,81 @@
+/* magicplan--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION magicplan" to load this file. \quit
+
+-- Register functions.
+CREATE FUNCTION magicplan_stats(
+    OUT fingerprint bigint,
+    OUT calls bigint,
+    OUT searches bigint,
+    OUT cache_hits bigint,
+    OUT candidates bigint,
+    OUT wins bigint,
+    OUT total_extra_time float8,
+    OUT max_extra_time float8,
+    OUT mean_base_cost float8,
+    OUT mean_chosen_cost float8
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'magicplan_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'magicplan_stats_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_set_sample_rate(fingerprint bigint, sample_rate integer)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'magicplan_set_sample_rate'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_decisions(
+    OUT fingerprint bigint,
+    OUT nsublinks integer,
+    OUT fenced bigint,
+    OUT fence_candidate bigint,
+    OUT relids oid[]
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'magicplan_decisions'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_import_decision(fingerprint bigint, nsublinks integer,
+                                          fenced bigint, fence_candidate bigint,
+                                          relids oid[] DEFAULT NULL)
+RETURNS void
+AS 'MODULE_PATHNAME', 'magicplan_import_decision'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_pin(fingerprint bigint, mode text, fenced bigint DEFAULT 0)
+RETURNS void
+AS 'MODULE_PATHNAME', 'magicplan_pin'
+LANGUAGE C VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_unpin(fingerprint bigint)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'magicplan_unpin'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE FUNCTION magicplan_pins(
+    OUT fingerprint bigint,
+    OUT mode text,
+    OUT fenced bigint
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'magicplan_list_pins'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+-- Register a view on the function for ease of use.
+CREATE VIEW pg_stat_magicplan AS
+  SELECT * FROM magicplan_stats();
+
+GRANT SELECT ON pg_stat_magicplan TO PUBLIC;
+
+-- Don't want this to be available to non-superusers.
+REVOKE ALL ON FUNCTION magicplan_stats_reset() FROM PUBLIC;
+REVOKE ALL ON FUNCTION magicplan_set_sample_rate(bigint, integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION magicplan_import_decision(bigint, integer, bigint, bigint, oid[]) FROM PUBLIC;
+REVOKE ALL ON FUNCTION magicplan_pin(bigint, text, bigint) FROM PUBLIC;
+REVOKE ALL ON FUNCTION magicplan_unpin(bigint) FROM PUBLIC;
@@ -0,0 +1,44 @@
+--
+-- CTE materialization, see magicplan.out for the other tests
+--
+-- Before PG12, CTEs are always materialized and never candidates, which
+-- gives cte_1.out.
+--
+LOAD 'magicplan';
+SET magicplan.ignore_cost_below = 0;
+SET magicplan.sublink_types = 'cte';
+
+CREATE TABLE items (id int PRIMARY KEY, category int);
+INSERT INTO items SELECT i, i % 10 FROM generate_series(1, 1000) i;
+ANALYZE items;
+
+CREATE FUNCTION magicplan_decision(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (COSTS off) ' || query LOOP
+        IF line ~ '^\s*(Decision|Candidate Sublinks|Candidates Planned):' THEN
+            RETURN NEXT btrim(line);
+        END IF;
+    END LOOP;
+END;
+$$;
+
+-- Referenced once, the CTE is inlined unless magicplan materializes it
+SELECT * FROM magicplan_decision('WITH c AS (SELECT * FROM items WHERE category = 1) SELECT * FROM c WHERE id < 100') AS d(line);
+
+-- Referenced twice or volatile, it is materialized anyway
+SELECT * FROM magicplan_decision('WITH c AS (SELECT * FROM items WHERE category = 1) SELECT * FROM c c1 JOIN c c2 ON c1.id = c2.id') AS d(line);
+SELECT * FROM magicplan_decision('WITH c AS (SELECT id, random() AS r FROM items) SELECT * FROM c WHERE id < 100') AS d(line);
+
+-- Whatever the plan, the results do not change
+SET magicplan.threshold = 0;
+SELECT count(*) FROM (WITH c AS (SELECT * FROM items WHERE category = 1) SELECT * FROM c WHERE id < 100) s;
+SET magicplan.enabled = off;
+SELECT count(*) FROM (WITH c AS (SELECT * FROM items WHERE category = 1) SELECT * FROM c WHERE id < 100) s;
+RESET magicplan.enabled;
+RESET magicplan.threshold;
+
+DROP FUNCTION magicplan_decision(text);
+DROP TABLE items;
@@ -0,0 +1,162 @@
+--
+-- magicplan regression tests
+--
+-- Meant for a server that does not preload magicplan: the decision cache
+-- would otherwise answer the repeated queries. Only the decisions are shown,
+-- never the plans, whose shape changes between PostgreSQL versions.
+--
+LOAD 'magicplan';
+SET magicplan.ignore_cost_below = 0;
+SET magicplan.prefilter_min_gain = 0;
+
+CREATE TABLE orders (id int PRIMARY KEY, customer int, status int);
+CREATE TABLE lines (order_id int, product int, qty int);
+INSERT INTO orders SELECT i, i % 100, i % 5 FROM generate_series(1, 10000) i;
+INSERT INTO lines SELECT i % 10000 + 1, i % 50, i % 3 FROM generate_series(1, 30000) i;
+CREATE INDEX lines_order_id ON lines (order_id);
+ANALYZE orders;
+ANALYZE lines;
+
+-- The Magicplan section of EXPLAIN, without the costs and the fenced
+-- sublinks, which depend on the cost model
+CREATE FUNCTION magicplan_decision(query text) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (COSTS off) ' || query LOOP
+        IF line ~ '^\s*(Decision|Candidate Sublinks|Candidates Planned):' THEN
+            RETURN NEXT btrim(line);
+        END IF;
+    END LOOP;
+END;
+$$;
+
+-- No sublink, nothing to do
+SELECT * FROM magicplan_decision('SELECT * FROM orders') AS d(line);
+
+-- EXISTS and NOT EXISTS
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE NOT EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+
+-- In the structured formats, the section is a property of the query, next
+-- to its plan
+CREATE FUNCTION magicplan_decision_json(query text)
+RETURNS TABLE (queries int, has_plan bool, decision text)
+LANGUAGE plpgsql AS $$
+DECLARE
+    result json;
+BEGIN
+    EXECUTE 'EXPLAIN (FORMAT JSON, COSTS off) ' || query INTO result;
+    RETURN QUERY SELECT json_array_length(result), result->0->'Plan' IS NOT NULL,
+        result->0->'Magicplan'->>'Decision';
+END;
+$$;
+SELECT * FROM magicplan_decision_json('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)');
+
+-- Nested EXISTS
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND EXISTS (SELECT 1 FROM orders o2 WHERE o2.id = l.order_id AND o2.status = 1))') AS d(line);
+
+-- A subquery with an OFFSET already is left alone, a LIMIT does not matter
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id OFFSET 0)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id LIMIT 1)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id) ORDER BY o.id LIMIT 10 OFFSET 5') AS d(line);
+
+-- The prefilter skips the sublinks the planner never pulls up
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.qty > 1)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT count(*) FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SET magicplan.prefilter = off;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.qty > 1)') AS d(line);
+RESET magicplan.prefilter;
+
+-- The estimated gain is the one of the outer relations, whatever the rows
+-- left after an aggregate or a LIMIT
+RESET magicplan.prefilter_min_gain;
+CREATE TABLE statuses (id int PRIMARY KEY);
+INSERT INTO statuses SELECT generate_series(0, 4);
+ANALYZE statuses;
+SELECT * FROM magicplan_decision('SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id) ORDER BY o.id LIMIT 10') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM statuses s WHERE s.id = o.status)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM statuses s WHERE s.id = o.status)') AS d(line);
+SET magicplan.prefilter_min_gain = 0;
+DROP TABLE statuses;
+
+-- Kinds of sublinks
+SET magicplan.sublink_types = 'not_exists';
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SET magicplan.sublink_types = 'exists, any';
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE o.id IN (SELECT l.order_id FROM lines l WHERE l.qty > 1)') AS d(line);
+SET magicplan.sublink_types = 'subquery';
+SELECT * FROM magicplan_decision('SELECT * FROM orders o JOIN (SELECT * FROM lines WHERE qty = 1) l ON l.order_id = o.id') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o JOIN (SELECT * FROM lines WHERE qty = 1 OFFSET 0) l ON l.order_id = o.id') AS d(line);
+SET magicplan.sublink_types = 'exists, foo';
+RESET magicplan.sublink_types;
+
+-- Plans with parameters: one-shot plans, like those of EXECUTE ... USING,
+-- never get a generic plan, and are searched whatever
+-- magicplan.prepared_plans says
+CREATE FUNCTION magicplan_decision_param(query text, param int) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (COSTS off) ' || query USING param LOOP
+        IF line ~ '^\s*(Decision|Candidate Sublinks|Candidates Planned):' THEN
+            RETURN NEXT btrim(line);
+        END IF;
+    END LOOP;
+END;
+$$;
+SET magicplan.prepared_plans = generic;
+SELECT * FROM magicplan_decision_param('SELECT * FROM orders o WHERE o.customer = $1 AND EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)', 5) AS d(line);
+SET magicplan.prepared_plans = custom;
+SELECT * FROM magicplan_decision_param('SELECT * FROM orders o WHERE o.customer = $1 AND EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)', 5) AS d(line);
+RESET magicplan.prepared_plans;
+
+-- Cheap queries
+SET magicplan.ignore_cost_below = 100000000;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+-- Without statistics, the adaptive mode falls back on the cost
+SET magicplan.adaptive = on;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+RESET magicplan.adaptive;
+SET magicplan.ignore_cost_below = 0;
+
+-- Search strategies and budget
+SET magicplan.search_strategy = exhaustive;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SET magicplan.search_strategy = beam;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+RESET magicplan.search_strategy;
+SET magicplan.max_candidates = 1;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND EXISTS (SELECT 1 FROM orders o2 WHERE o2.id = l.order_id AND o2.status = 1))') AS d(line);
+RESET magicplan.max_candidates;
+
+-- The EXPLAIN of magicplan_decision runs one level below the top-level
+-- statement
+SET magicplan.max_nesting_level = 0;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SET magicplan.max_nesting_level = 1;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+RESET magicplan.max_nesting_level;
+
+-- Whatever the plan, the results do not change
+SET magicplan.threshold = 0;
+SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.qty = 2);
+SELECT count(*) FROM orders o WHERE NOT EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 7);
+SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND EXISTS (SELECT 1 FROM orders o2 WHERE o2.id = l.order_id AND o2.status = 1));
+SELECT o.id FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 7) ORDER BY o.id LIMIT 3;
+SET magicplan.enabled = off;
+SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.qty = 2);
+SELECT count(*) FROM orders o WHERE NOT EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 7);
+SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND EXISTS (SELECT 1 FROM orders o2 WHERE o2.id = l.order_id AND o2.status = 1));
+SELECT o.id FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 7) ORDER BY o.id LIMIT 3;
+RESET magicplan.enabled;
+RESET magicplan.threshold;
+
+DROP FUNCTION magicplan_decision(text);
+DROP FUNCTION magicplan_decision_json(text);
+DROP FUNCTION magicplan_decision_param(text, integer);
+DROP TABLE lines;
+DROP TABLE orders;
@@ -0,0 +1,223 @@
+--
+-- magicplan regression tests of the shared memory features
+--
+-- Meant for the temporary instance of "make check", which
+-- preloads magicplan with the settings of magicplan.conf. The fingerprints
+-- depend on the relation OIDs, they are kept in psql variables and never
+-- shown.
+--
+CREATE EXTENSION magicplan;
+
+-- The objects of the SQL script
+SELECT pg_describe_object(classid, objid, objsubid) COLLATE "C" AS object
+FROM pg_depend
+WHERE refclassid = 'pg_extension'::regclass
+  AND refobjid = (SELECT oid FROM pg_extension WHERE extname = 'magicplan')
+  AND deptype = 'e'
+ORDER BY 1;
+SELECT has_table_privilege('public', 'pg_stat_magicplan', 'SELECT') AS stats_view,
+       has_function_privilege('public', 'magicplan_stats_reset()', 'EXECUTE') AS stats_reset,
+       has_function_privilege('public', 'magicplan_pin(bigint, text, bigint)', 'EXECUTE') AS pin;
+
+SET magicplan.ignore_cost_below = 0;
+SET magicplan.prefilter_min_gain = 0;
+-- Whatever the costs, the searches below must not put a query in the
+-- negative cache, but the one testing it
+SET magicplan.negative_cache_losses = 1000;
+
+CREATE TABLE orders (id int PRIMARY KEY, customer int, status int);
+CREATE TABLE lines (order_id int, product int, qty int);
+INSERT INTO orders SELECT i, i % 100, i % 5 FROM generate_series(1, 10000) i;
+INSERT INTO lines SELECT i % 10000 + 1, i % 50, i % 3 FROM generate_series(1, 30000) i;
+CREATE INDEX lines_order_id ON lines (order_id);
+ANALYZE orders;
+ANALYZE lines;
+
+-- The Magicplan section of EXPLAIN, without the costs, and without the
+-- fenced sublinks unless they are asked for
+CREATE FUNCTION magicplan_decision(query text, fenced bool DEFAULT false) RETURNS SETOF text
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (COSTS off) ' || query LOOP
+        IF line ~ '^\s*(Decision|Candidate Sublinks|Candidates Planned):' OR
+           (fenced AND line ~ '^\s*Fenced Sublinks:') THEN
+            RETURN NEXT btrim(line);
+        END IF;
+    END LOOP;
+END;
+$$;
+
+-- The fingerprint of a query, planning it once
+CREATE FUNCTION magicplan_fingerprint(query text) RETURNS bigint
+LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (VERBOSE, COSTS off) ' || query LOOP
+        IF line ~ '^\s*Fingerprint:' THEN
+            RETURN split_part(btrim(line), ': ', 2)::bigint;
+        END IF;
+    END LOOP;
+    RETURN NULL;
+END;
+$$;
+
+SELECT magicplan_stats_reset();
+
+-- The first planning searches, the next ones use the decision cache
+SELECT magicplan_fingerprint('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS fp \gset
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT calls, searches, cache_hits FROM pg_stat_magicplan WHERE fingerprint = :fp;
+
+-- Export and import
+SELECT nsublinks, (SELECT string_agg(DISTINCT r::regclass::text, ', ' ORDER BY r::regclass::text) FROM unnest(relids) r) AS relids
+FROM magicplan_decisions() WHERE fingerprint = :fp;
+CREATE TEMP TABLE exported AS SELECT * FROM magicplan_decisions() WHERE fingerprint = :fp;
+-- Without the relations, the decision is searched again at the next planning
+SELECT magicplan_import_decision(fingerprint, nsublinks, fenced, fence_candidate, NULL) FROM exported;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT magicplan_import_decision(fingerprint, nsublinks, fenced, fence_candidate, relids) FROM exported;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT magicplan_import_decision(:fp, NULL, 0, 0);
+
+-- A change of the statistics of a relation makes the decision stale, it is
+-- searched again once
+INSERT INTO lines SELECT i % 10000 + 1, i % 50, i % 3 FROM generate_series(1, 10000) i;
+ANALYZE lines;
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT calls, searches, cache_hits FROM pg_stat_magicplan WHERE fingerprint = :fp;
+
+-- Pins override the decision cache
+SELECT magicplan_pin(:fp, 'pristine');
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)', true) AS d(line);
+SELECT magicplan_pin(:fp, 'fence', 1);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)', true) AS d(line);
+SELECT magicplan_pin(:fp, 'search');
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+SELECT mode, fenced FROM magicplan_pins() WHERE fingerprint = :fp;
+SELECT magicplan_pin(:fp, 'sometimes');
+SELECT magicplan_unpin(:fp);
+SELECT magicplan_unpin(:fp);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id)') AS d(line);
+
+-- Unpinned fingerprints leave room for new ones, up to magicplan.max_pins
+-- pinned at a time
+SELECT magicplan_pin(i, 'pristine'), magicplan_unpin(i) FROM generate_series(1, 5) i;
+SELECT magicplan_pin(6, 'pristine');
+SELECT magicplan_pin(7, 'fence', 1);
+SELECT magicplan_pin(8, 'pristine');
+SELECT * FROM magicplan_pins() ORDER BY fingerprint;
+SELECT magicplan_unpin(6), magicplan_unpin(7);
+SELECT magicplan_pin(8, 'pristine');
+SELECT magicplan_unpin(8);
+
+-- Sampled searches, and the negative cache: the query is no longer
+-- searched once its last three searches kept the pristine plan
+RESET magicplan.negative_cache_losses;
+SELECT magicplan_fingerprint('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.qty > 1)') AS nfp \gset
+SELECT magicplan_set_sample_rate(:nfp, 1);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.qty > 1)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.qty > 1)') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.qty > 1)') AS d(line);
+SELECT magicplan_set_sample_rate(:nfp, 1);
+SELECT count(*) FROM magicplan_decisions() WHERE fingerprint = :nfp;
+SELECT calls, searches, cache_hits FROM pg_stat_magicplan WHERE fingerprint = :nfp;
+SET magicplan.negative_cache_losses = 1000;
+
+-- A search failing once it holds the search slot of its query leaves
+-- nothing behind, the next planning searches again. The function fails at
+-- its second call, when the first candidate is planned.
+CREATE SEQUENCE plannings;
+CREATE FUNCTION fail_second_planning() RETURNS int
+LANGUAGE plpgsql IMMUTABLE AS $$
+BEGIN
+    IF nextval('plannings') = 2 THEN
+        RAISE EXCEPTION 'failed to plan a candidate';
+    END IF;
+    RETURN 3;
+END;
+$$;
+\set VERBOSITY terse
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.qty < fail_second_planning())') AS d(line);
+\set VERBOSITY default
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.qty < fail_second_planning())') AS d(line);
+SELECT * FROM magicplan_decision('SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.qty < fail_second_planning())') AS d(line);
+
+-- With magicplan.prepared_plans = generic, the custom plans made before the
+-- generic plan search the query, and the generic plan searches it again
+-- for the custom plans made after it
+SET magicplan.prepared_plans = generic;
+PREPARE by_qty(int) AS SELECT * FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.qty = $1);
+SET plan_cache_mode = force_custom_plan;
+SELECT * FROM magicplan_decision('EXECUTE by_qty(1)') AS d(line);
+SELECT * FROM magicplan_decision('EXECUTE by_qty(2)') AS d(line);
+SET plan_cache_mode = force_generic_plan;
+SELECT * FROM magicplan_decision('EXECUTE by_qty(1)') AS d(line);
+SET plan_cache_mode = force_custom_plan;
+SELECT * FROM magicplan_decision('EXECUTE by_qty(2)') AS d(line);
+RESET plan_cache_mode;
+DEALLOCATE by_qty;
+RESET magicplan.prepared_plans;
+
+-- Background searches. The workers only get the settings of the database,
+-- not the ones of the session
+ALTER DATABASE :"DBNAME" SET magicplan.ignore_cost_below = 0;
+-- Wait for the decision of a background search, and for its worker to
+-- exit, which adds its statistics
+CREATE FUNCTION magicplan_wait_search(fp bigint) RETURNS bool
+LANGUAGE plpgsql AS $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        PERFORM pg_stat_clear_snapshot();
+        IF EXISTS (SELECT 1 FROM magicplan_decisions() WHERE fingerprint = fp) AND
+           NOT EXISTS (SELECT 1 FROM pg_stat_activity WHERE backend_type = 'magicplan search') THEN
+            RETURN true;
+        END IF;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    RETURN false;
+END;
+$$;
+CREATE TABLE async_runs (n int);
+INSERT INTO async_runs VALUES (0);
+-- The fingerprint of the query, without searching it
+SET magicplan.ignore_cost_below = 100000000;
+SELECT magicplan_fingerprint('SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 3)') AS afp \gset
+SET magicplan.ignore_cost_below = 0;
+SET magicplan.async_search = on;
+-- The query of a utility command gets the whole string as its text, the
+-- worker would run the UPDATE again: it is searched inline. So is the
+-- query of EXPLAIN.
+CREATE TABLE async_ctas AS SELECT o.id FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product < 4) \; UPDATE async_runs SET n = n + 1;
+SELECT * FROM magicplan_decision('SELECT o.customer FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product > 5)') AS d(line);
+-- A SELECT is planned as it is, and searched by a worker for the next
+-- executions
+SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 3);
+SELECT calls, searches, cache_hits FROM pg_stat_magicplan WHERE fingerprint = :afp;
+SELECT magicplan_wait_search(:afp);
+SELECT * FROM magicplan_decision('SELECT count(*) FROM orders o WHERE EXISTS (SELECT 1 FROM lines l WHERE l.order_id = o.id AND l.product = 3)') AS d(line);
+SELECT n FROM async_runs;
+RESET magicplan.async_search;
+ALTER DATABASE :"DBNAME" RESET magicplan.ignore_cost_below;
+DROP FUNCTION magicplan_wait_search(bigint);
+DROP TABLE async_ctas;
+DROP TABLE async_runs;
+
+-- Forgetting the statistics
+SELECT magicplan_stats_reset();
+SELECT count(*) FROM pg_stat_magicplan;
+
+RESET magicplan.negative_cache_losses;
+RESET magicplan.prefilter_min_gain;
+RESET magicplan.ignore_cost_below;
+DROP FUNCTION fail_second_planning();
+DROP SEQUENCE plannings;
+DROP FUNCTION magicplan_fingerprint(text);
+DROP FUNCTION magicplan_decision(text, bool);
+DROP TABLE lines;
+DROP TABLE orders;
+DROP EXTENSION magicplan;
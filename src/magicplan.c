@@ -5,41 +5,596 @@
  */
 #include "postgres.h"
 #include "fmgr.h"
+#include "miscadmin.h"
 
+#include <math.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/namespace.h"
 #include "commands/explain.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "funcapi.h"
 #include "optimizer/planner.h"
+#include "parser/parser.h"
+#include "parser/parsetree.h"
+#include "executor/spi.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#if PG_VERSION_NUM >= 120000
+#include "optimizer/optimizer.h"
+#else
+#include "optimizer/planmain.h"
+#include "optimizer/var.h"
+#endif
+#include "catalog/pg_class.h"
+#include "catalog/pg_statistic.h"
 #include "catalog/pg_type.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#if PG_VERSION_NUM >= 160000
+#include "nodes/queryjumble.h"
+#elif PG_VERSION_NUM >= 140000
+#include "utils/queryjumble.h"
+#endif
+#include "storage/fd.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
 #include "nodes/makefuncs.h"
 #include "nodes/nodeFuncs.h"
+#include "portability/instr_time.h"
+#include "port/atomics.h"
+#include "tcop/tcopprot.h"
+#include "tcop/utility.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/selfuncs.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#include "utils/varlena.h"
 
 PG_MODULE_MAGIC;
 
 static planner_hook_type prev_planner = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+static ExecutorEnd_hook_type prev_ExecutorEnd = NULL;
+static ProcessUtility_hook_type prev_ProcessUtility = NULL;
+static ExplainOneQuery_hook_type prev_ExplainOneQuery = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
 
 void _PG_init(void);
 void _PG_fini(void);
+PGDLLEXPORT void magicplan_worker_main(Datum main_arg);
+
+
+/*
+ * Candidate sublinks are numbered in the order the scan walker meets them,
+ * and a decision is stored as a bitmask of the ones that got an OFFSET 0.
+ * Sublinks past this limit are never fenced.
+ */
+#define MAGICPLAN_MAX_SUBLINKS 64
+
+/*
+ * Context for the read-only scan done before doing anything costly. It also
+ * records the subquery of each candidate sublink, so that the OFFSET 0 can
+ * later be set or removed directly, without walking the tree again.
+ */
+typedef struct
+{
+	int nsublinks;             // Number of candidate sublinks found
+	int nenabled;              // The ones allowed by magicplan.sublink_types
+	uint64 enabled;            // Positions of the enabled ones
+	bool negated;              // The next sublink is under a NOT
+	bool has_params;           // The query uses external parameters
+	Query *current;            // Query being walked
+	Query *subqueries[MAGICPLAN_MAX_SUBLINKS]; // Subquery of each candidate
+	Query *parents[MAGICPLAN_MAX_SUBLINKS]; // Query it is in
+	CommonTableExpr *ctes[MAGICPLAN_MAX_SUBLINKS]; // Its CTE, if it is one
+	uint8 kinds[MAGICPLAN_MAX_SUBLINKS]; // MAGICPLAN_SUBLINK_* of each one
+} magicplan_scan_context;
 
+/*
+ * The scan also looks at the range table entries, to find the subqueries in
+ * FROM. The flag got renamed in PG12.
+ */
+#if PG_VERSION_NUM >= 120000
+#define MAGICPLAN_SCAN_FLAGS QTW_EXAMINE_RTES_BEFORE
+#else
+#define MAGICPLAN_SCAN_FLAGS QTW_EXAMINE_RTES
+#endif
 
 /*
- * Context for keeping the state across the whole mutator
- * tree walking.
+ * Context for keeping the state across the whole search.
  */
 typedef struct
 {
 	// Actual state
-	Query *base_query;         // Original query
-	Query *best_query;         // Current best rewritten query
+	Query *base_query;         // Original query, fences are set in place
 	PlannedStmt *base_plan;    // Original plan
 	PlannedStmt *best_plan;    // Best rewritten plan
-	// Arguments to easily call the planner from the tree
-	// traversal
+	// Arguments to easily call the planner
 	Query *current_query;      // Query to plan when calling real_plan
 	const char *queryString;   // For PG >= 13, query string is needed
 	int cursorOptions;         // Cursor options for planification
 	ParamListInfo boundParams; // Bound params
+	uint64 fingerprint;        // Key of the query in the caches, 0 if none
+	// Sublink bookkeeping, used by the decision cache
+	magicplan_scan_context scan; // Candidate sublinks of base_query
+	uint64 fenced;             // Sublinks with an OFFSET 0 in best_plan
+	Node *offset_zero;         // The OFFSET 0 expression to inject
+	int nranked;               // Enabled sublinks kept by the prefilter,
+	int ranked[MAGICPLAN_MAX_SUBLINKS]; // the most promising first
+	uint64 same_cost;          // Sublinks whose OFFSET 0 alone leaves the cost unchanged
+	uint64 query_signature;    // See magicplan_query_signature, 0 until computed
+	// Memory contexts holding base_plan and best_plan, along with the query
+	// they were planned from. Losing candidates are freed right away.
+	MemoryContext base_context;
+	MemoryContext best_context;
+	Size peak_memory;          // Highest memory use seen during the search
+	int candidates;            // Number of candidates planned
+	// Search budget
+	instr_time search_start;   // When the search began, after the pristine plan
+	double base_planning_time; // Time spent planning the pristine query, in ms
+	bool budget_exhausted;     // Set once the search had to stop
+	// Planning time of each candidate, only kept for
+	// magicplan.log_min_search_duration
+	StringInfo candidate_times;
+
+} magicplan_search_context;
+
+/*
+ * Search strategies, see magicplan.search_strategy
+ */
+typedef enum
+{
+	MAGICPLAN_SEARCH_GREEDY,
+	MAGICPLAN_SEARCH_EXHAUSTIVE,
+	MAGICPLAN_SEARCH_BEAM
+} magicplanSearchStrategy;
+
+static const struct config_enum_entry search_strategy_options[] = {
+	{"greedy", MAGICPLAN_SEARCH_GREEDY, false},
+	{"exhaustive", MAGICPLAN_SEARCH_EXHAUSTIVE, false},
+	{"beam", MAGICPLAN_SEARCH_BEAM, false},
+	{NULL, 0, false}
+};
+
+#define MAGICPLAN_MAX_BEAM_WIDTH 16
+
+/*
+ * Plans of prepared statements that are searched, see
+ * magicplan.prepared_plans
+ */
+typedef enum
+{
+	MAGICPLAN_PREPARED_ALL,
+	MAGICPLAN_PREPARED_GENERIC,
+	MAGICPLAN_PREPARED_CUSTOM
+} magicplanPreparedPlans;
+
+static const struct config_enum_entry prepared_plans_options[] = {
+	{"all", MAGICPLAN_PREPARED_ALL, false},
+	{"generic", MAGICPLAN_PREPARED_GENERIC, false},
+	{"custom", MAGICPLAN_PREPARED_CUSTOM, false},
+	{NULL, 0, false}
+};
+
+/*
+ * How the queries are identified in the caches and the statistics, see
+ * magicplan.fingerprint
+ */
+typedef enum
+{
+	MAGICPLAN_FINGERPRINT_AUTO,
+	MAGICPLAN_FINGERPRINT_QUERY_ID,
+	MAGICPLAN_FINGERPRINT_STRUCTURAL
+} magicplanFingerprint;
+
+static const struct config_enum_entry fingerprint_options[] = {
+	{"auto", MAGICPLAN_FINGERPRINT_AUTO, false},
+	{"query_id", MAGICPLAN_FINGERPRINT_QUERY_ID, false},
+	{"structural", MAGICPLAN_FINGERPRINT_STRUCTURAL, false},
+	{NULL, 0, false}
+};
+
+/*
+ * A combination of fences kept in the beam, with the cost of its plan
+ */
+typedef struct
+{
+	uint64 fences;
+	Cost cost;
+} magicplan_beam_state;
+
+/*
+ * Kinds of sublinks that can get an OFFSET 0, see magicplan.sublink_types.
+ * CTEs are fenced by materializing them, and subqueries in FROM get an
+ * OFFSET 0 like sublinks do.
+ */
+#define MAGICPLAN_SUBLINK_EXISTS		0x01
+#define MAGICPLAN_SUBLINK_NOT_EXISTS	0x02
+#define MAGICPLAN_SUBLINK_ANY			0x04
+#define MAGICPLAN_SUBLINK_CTE			0x08
+#define MAGICPLAN_SUBLINK_SUBQUERY		0x10
+
+/*
+ * Number of relations a cached decision lists as its dependencies. The
+ * decisions depending on more than that are checked against the relations
+ * of the query instead, see magicplan_plan_signature.
+ */
+#define MAGICPLAN_MAX_RELIDS 8
+
+/*
+ * Decision cache entry, stored in shared memory and keyed by the query
+ * fingerprint, see magicplan_fingerprint.
+ */
+typedef struct magicplanCacheEntry
+{
+	uint64 fingerprint;        // Hash key
+	int nsublinks;             // Number of candidate sublinks in the query
+	uint64 fenced;             // Sublinks that got an OFFSET 0
+	uint64 fence_candidate;    // Best OFFSET 0 placement, even if not used
+	double candidate_ratio;    // Pristine cost / fence_candidate cost, 0 if unknown
+	uint64 same_cost;          // Sublinks whose OFFSET 0 alone left the cost unchanged
+	bool custom_plan;          // Searched on a custom plan, with bound parameters
+	int nrelids;               // Relations the decision depends on,
+	Oid relids[MAGICPLAN_MAX_RELIDS]; // -1 if there are too many
+	uint64 signature;          // State of these relations when it was stored
+	slock_t mutex;             // Serializes the changes of the fields below
+	uint32 changecount;        // Odd while the fields below are being changed
+	bool stale;                // A relation changed since, searched again
+	TimestampTz last_used;     // Used to pick a victim when the cache is full
+	int sample_rate;           // Overrides magicplan.sample_rate if >= 0
+	// Execution feedback, times are in milliseconds
+	int64 pristine_runs;
+	double pristine_time;
+	int64 fenced_runs;         // Runs with the fence_candidate placement
+	double fenced_time;
+} magicplanCacheEntry;
+
+/*
+ * Backend-local memory of the sublinks fenced in the plans made for each
+ * query identifier, so that the executor hooks know which variant ran.
+ */
+typedef struct magicplanFeedbackEntry
+{
+	uint64 queryid;            // Hash key, PlannedStmt->queryId
+	uint64 fingerprint;        // Decision cache entry
+	uint64 fenced;             // Sublinks fenced in the last plan
+} magicplanFeedbackEntry;
+
+#define MAGICPLAN_FEEDBACK_MAX_ENTRIES 1024
+
+static HTAB *magicplan_feedback_hash = NULL;
+
+/*
+ * Execution time of a cost unit, in milliseconds, used by magicplan.adaptive
+ * to weigh cost savings against planning time. This is a rough guess for the
+ * default cost settings and cached data, replaced by a moving average of the
+ * executions timed by the feedback.
+ */
+#define MAGICPLAN_DEFAULT_MS_PER_COST 0.005
+
+static double magicplan_ms_per_cost = MAGICPLAN_DEFAULT_MS_PER_COST;
+
+/*
+ * Statistics kept for each query fingerprint, see pg_stat_magicplan.
+ * Times are in milliseconds.
+ */
+typedef struct magicplanCounters
+{
+	int64 calls;               // Planner calls for the query
+	int64 searches;            // Calls that searched for OFFSET 0 placements
+	int64 cache_hits;          // Calls that used the cached decision
+	int64 candidates;          // Candidate plans made during searches
+	int64 wins;                // Searches where the OFFSET 0 plan was used
+	double total_extra_time;   // Planning time spent beyond the pristine plan
+	double max_extra_time;
+	double sum_base_cost;      // Pristine plan cost, summed over searches
+	double sum_chosen_cost;    // Chosen plan cost, summed over searches
+} magicplanCounters;
+
+typedef struct magicplanStatsEntry
+{
+	uint64 fingerprint;        // Hash key
+	slock_t mutex;             // Protects the fields below
+	magicplanCounters counters;
+	TimestampTz last_used;     // Used to pick a victim when the table is full
+} magicplanStatsEntry;
+
+/*
+ * Counters of the planner calls not yet added to the shared statistics by
+ * this backend. They are flushed by the planner calls or the executions
+ * finding the last flush older than MAGICPLAN_STATS_FLUSH_MS, when
+ * MAGICPLAN_STATS_MAX_PENDING queries are pending, and when the backend
+ * exits, so that the backends planning the same query do not all lock its
+ * entry at each call.
+ */
+typedef struct magicplanPendingStats
+{
+	uint64 fingerprint;        // Hash key
+	magicplanCounters counters;
+	TimestampTz last_used;
+} magicplanPendingStats;
+
+#define MAGICPLAN_STATS_FLUSH_MS 500
+#define MAGICPLAN_STATS_MAX_PENDING 256
+
+static HTAB *magicplan_pending_stats = NULL;
+static TimestampTz magicplan_stats_last_flush = 0;
+
+/*
+ * The decision cache and the statistics are both split in partitions, each
+ * one a hash table with its own lock, so that the backends planning
+ * different queries do not queue on the same lock. A fingerprint always maps
+ * to the same partition, and a full partition evicts its own least recently
+ * used entry.
+ */
+#define MAGICPLAN_NUM_PARTITIONS 16
+#define MAGICPLAN_PARTITION(fingerprint) ((int) ((fingerprint) % MAGICPLAN_NUM_PARTITIONS))
+#define MAGICPLAN_PARTITION_SIZE(size) \
+	(((size) + MAGICPLAN_NUM_PARTITIONS - 1) / MAGICPLAN_NUM_PARTITIONS)
+
+/*
+ * Global shared state
+ */
+typedef struct magicplanSharedState
+{
+	LWLock *cache_locks[MAGICPLAN_NUM_PARTITIONS]; // Protect each decision cache partition
+	LWLock *stats_locks[MAGICPLAN_NUM_PARTITIONS]; // Protect each statistics partition
+	LWLock *pins_lock;         // Serializes the changes of the pins
+	int npins;                 // Pin slots in use, unpinned ones included
+	int nlive;                 // Pinned fingerprints among them
+	uint32 pins_changecount;   // Odd while the pin slots are rehashed
+	uint32 cache_changecounts[MAGICPLAN_NUM_PARTITIONS]; // Odd while a partition is changed
+} magicplanSharedState;
+
+static magicplanSharedState *magicplan_state = NULL;
+static HTAB *magicplan_cache[MAGICPLAN_NUM_PARTITIONS];
+static HTAB *magicplan_stats_hash[MAGICPLAN_NUM_PARTITIONS];
+
+#define MAGICPLAN_CACHE_AVAILABLE() (magicplan_cache[0] != NULL)
+#define MAGICPLAN_STATS_AVAILABLE() (magicplan_stats_hash[0] != NULL)
+
+/*
+ * The execution feedback and the sample rate of a decision cache entry are
+ * changed with the partition lock held in shared mode. Lookups copy the entry
+ * without taking its spinlock, and start again when its change counter moved
+ * or is odd, see magicplan_cache_read.
+ */
+#define MAGICPLAN_ENTRY_BEGIN_WRITE(entry) \
+	do { \
+		SpinLockAcquire(&(entry)->mutex); \
+		(entry)->changecount++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define MAGICPLAN_ENTRY_END_WRITE(entry) \
+	do { \
+		pg_write_barrier(); \
+		(entry)->changecount++; \
+		SpinLockRelease(&(entry)->mutex); \
+	} while (0)
+
+/*
+ * Adding or removing the entries of a decision cache partition needs its
+ * lock in exclusive mode, and makes its change counter odd meanwhile, so
+ * that lookups can search the partition without the lock, see
+ * magicplan_cache_lookup.
+ */
+#define MAGICPLAN_PARTITION_BEGIN_WRITE(partition) \
+	do { \
+		magicplan_state->cache_changecounts[partition]++; \
+		pg_write_barrier(); \
+	} while (0)
+
+#define MAGICPLAN_PARTITION_END_WRITE(partition) \
+	do { \
+		pg_write_barrier(); \
+		magicplan_state->cache_changecounts[partition]++; \
+	} while (0)
+
+/*
+ * Lock-free searches of a partition tried by a lookup, before it takes the
+ * partition lock because the entries keep changing.
+ */
+#define MAGICPLAN_CACHE_READ_TRIES 3
+
+/*
+ * A lookup only refreshes the LRU timestamp of an entry older than this, so
+ * that the entries of hot queries are not written at each lookup.
+ */
+#define MAGICPLAN_LAST_USED_PRECISION_MS 1000
+
+/*
+ * Negative cache slot. The negative cache is a direct-mapped array of these,
+ * indexed by the query fingerprint, remembering the query shapes whose
+ * searches keep ending with the pristine plan. A colliding fingerprint simply
+ * takes over the slot.
+ */
+typedef struct magicplanNegativeSlot
+{
+	uint64 fingerprint;        // 0 for an unused slot
+	uint32 losses;             // Searches in a row that kept the pristine plan
+	uint32 skips;              // Searches skipped since the last one
+	slock_t mutex;             // Protects the fields above
+} magicplanNegativeSlot;
+
+static magicplanNegativeSlot *magicplan_negative_cache = NULL;
+
+/*
+ * Pinned decisions, set with magicplan_pin. They live in an open-addressed
+ * array of twice magicplan.max_pins slots, with linear probing from the
+ * fingerprint. An unpinned slot keeps its fingerprint with the
+ * MAGICPLAN_PIN_NONE mode, so that probing goes on past it, and it is reused
+ * by the next pin in its probe sequence. When a new pin finds no such slot
+ * and half of the slots are used, the pinned fingerprints are rehashed
+ * without the unpinned ones.
+ * The planner reads the slots without any lock, each slot being protected by a
+ * change counter that is odd while a change is being written, like the
+ * backend status in pgstat. The whole array has one too, for the rehashes.
+ */
+typedef enum
+{
+	MAGICPLAN_PIN_NONE,        // Unpinned
+	MAGICPLAN_PIN_PRISTINE,    // Always plan the query as it is
+	MAGICPLAN_PIN_FENCE,       // Always fence the given sublinks
+	MAGICPLAN_PIN_SEARCH       // Always search, ignoring the caches
+} magicplanPinMode;
+
+static const char *const magicplan_pin_modes[] = {"none", "pristine", "fence", "search"};
+
+/*
+ * Searches in progress, so that the backends planning the same new query at
+ * the same time do not all search it. This is a direct-mapped array indexed
+ * by the fingerprint, like the negative cache: a query colliding with the
+ * search of another one is searched as usual.
+ */
+#define MAGICPLAN_FLIGHT_SLOTS 256
+
+typedef struct magicplanFlightSlot
+{
+	uint64 fingerprint;        // 0 for an unused slot
+	int pid;                   // Backend running the search
+	slock_t mutex;             // Protects the fields above
+} magicplanFlightSlot;
+
+static magicplanFlightSlot *magicplan_flights = NULL;
+
+typedef struct magicplanPinSlot
+{
+	uint32 changecount;        // Odd while being written
+	uint64 fingerprint;        // 0 for a slot never used
+	uint64 fenced;             // Sublinks to fence, for MAGICPLAN_PIN_FENCE
+	int mode;                  // magicplanPinMode
+} magicplanPinSlot;
+
+static magicplanPinSlot *magicplan_pins = NULL;
+
+#define MAGICPLAN_PIN_SLOTS() (2 * magicplan_max_pins)
+
+/*
+ * The pins are saved in this file at each change, and loaded back at
+ * startup, even after a crash.
+ */
+#define MAGICPLAN_PINS_FILE "pg_stat/magicplan_pins.stat"
+
+static const uint32 MAGICPLAN_PINS_FILE_HEADER = 0x4d505031;
+
+/*
+ * The decision cache is saved in this file at shutdown, and loaded back at
+ * startup, see magicplan.save
+ */
+#define MAGICPLAN_DUMP_FILE "pg_stat/magicplan.stat"
+
+/* Magic number identifying the file format */
+static const uint32 MAGICPLAN_FILE_HEADER = 0x4d504c31;
+
+/*
+ * Queue of the searches left to background workers, see
+ * magicplan.async_search. Each slot is searched by its own dynamic worker,
+ * connected to the database of the query, which runs an EXPLAIN of the query
+ * text: the planner hook does the search and stores the decision in the
+ * cache.
+ * A slot is only written by the backend queuing it (FILLING) and then only
+ * read by its worker (RUNNING), the mutex only protects the state changes.
+ */
+typedef enum
+{
+	MAGICPLAN_ASYNC_FREE,
+	MAGICPLAN_ASYNC_FILLING,
+	MAGICPLAN_ASYNC_QUEUED,
+	MAGICPLAN_ASYNC_RUNNING
+} magicplanAsyncState;
 
-} magicplan_mutator_context;
+#define MAGICPLAN_ASYNC_SEARCH_PATH_LEN 1024
+
+/* Queued slots whose worker did not show up are reused after that long */
+#define MAGICPLAN_ASYNC_STALE_MS 60000
+
+typedef struct magicplanAsyncSlot
+{
+	slock_t mutex;             // Protects state and generation
+	magicplanAsyncState state;
+	uint32 generation;         // Bumped each time the slot is queued
+	TimestampTz queued_at;
+	uint64 fingerprint;
+	Oid dboid;
+	Oid roleid;
+	char search_path[MAGICPLAN_ASYNC_SEARCH_PATH_LEN];
+	char query[FLEXIBLE_ARRAY_MEMBER]; // pgstat_track_activity_query_size long
+} magicplanAsyncSlot;
+
+static char *magicplan_async_queue = NULL;
+
+#define ASYNC_SLOT_SIZE() \
+	MAXALIGN(offsetof(magicplanAsyncSlot, query) + pgstat_track_activity_query_size)
+#define ASYNC_SLOT(i) \
+	((magicplanAsyncSlot *) (magicplan_async_queue + (Size) (i) * ASYNC_SLOT_SIZE()))
+
+/*
+ * In a background worker, fingerprint of the query to search. It is taken
+ * by the next planner call, which then searches and stores the decision
+ * whatever the cache says, and tells so through magicplan_async_done.
+ */
+static uint64 magicplan_async_target = 0;
+static bool magicplan_async_done = false;
+
+/*
+ * What magicplan did during the last planner call of this backend, shown by
+ * EXPLAIN.
+ */
+typedef enum
+{
+	MAGICPLAN_DECISION_NONE,   // No candidate sublink, or magicplan disabled
+	MAGICPLAN_DECISION_CACHED, // The cached decision was applied
+	MAGICPLAN_DECISION_CHEAP,  // Below magicplan.ignore_cost_below
+	MAGICPLAN_DECISION_ADAPTIVE, // Expected savings below the search overhead
+	MAGICPLAN_DECISION_NEGATIVE, // Skipped by the negative cache
+	MAGICPLAN_DECISION_NESTED, // Above magicplan.max_nesting_level
+	MAGICPLAN_DECISION_PREPARED, // Plan kind excluded by magicplan.prepared_plans
+	MAGICPLAN_DECISION_PINNED, // Pinned to the pristine plan or to fences
+	MAGICPLAN_DECISION_QUEUED, // Left to a background worker
+	MAGICPLAN_DECISION_CONCURRENT, // Being searched by another backend
+	MAGICPLAN_DECISION_SEARCHED
+} magicplanDecision;
+
+typedef struct magicplanDecisionReport
+{
+	magicplanDecision decision;
+	uint64 fingerprint;        // Key of the query in the caches
+	int nsublinks;             // Number of candidate sublinks in the query
+	uint64 fenced;             // Sublinks fenced in the returned plan
+	int candidates;            // Candidate plans made
+	Cost base_cost;            // Pristine plan cost, if it was planned
+	Cost chosen_cost;          // Returned plan cost, if searched
+	double extra_time;         // Time spent searching, in milliseconds
+} magicplanDecisionReport;
+
+static magicplanDecisionReport magicplan_last_decision;
+
+/*
+ * Nesting level of the statement being run or planned: 0 for a top-level
+ * statement, more for the ones run by functions, triggers or DO blocks. It
+ * is tracked through the executor, utility and planner hooks like
+ * pg_stat_statements does, and restored by them on error.
+ */
+static int magicplan_nesting_level = 0;
 
 
 /*
@@ -49,14 +604,49 @@ typedef struct
 #if PG_VERSION_NUM >= 130000
 #define HOOK_ARGS Query *parse, const char* queryString, int cursorOptions, ParamListInfo boundParams
 #define HOOK_PARAMS(prefix) prefix->current_query, prefix->queryString, prefix->cursorOptions, prefix->boundParams
+#define HOOK_ARG_NAMES parse, queryString, cursorOptions, boundParams
 #else
 #define HOOK_ARGS Query *parse, int cursorOptions, ParamListInfo boundParams
 #define HOOK_PARAMS(prefix) prefix->current_query, prefix->cursorOptions, prefix->boundParams
+#define HOOK_ARG_NAMES parse, cursorOptions, boundParams
+#endif
+
+/*
+ * Same for ProcessUtility, which got a readOnlyTree argument in PG14 and a
+ * QueryCompletion instead of the completion tag in PG13
+ */
+#if PG_VERSION_NUM >= 140000
+#define PROCESS_UTILITY_ARGS PlannedStmt *pstmt, const char *queryString, bool readOnlyTree, \
+	ProcessUtilityContext context, ParamListInfo params, QueryEnvironment *queryEnv, \
+	DestReceiver *dest, QueryCompletion *qc
+#define PROCESS_UTILITY_PARAMS pstmt, queryString, readOnlyTree, context, params, queryEnv, dest, qc
+#elif PG_VERSION_NUM >= 130000
+#define PROCESS_UTILITY_ARGS PlannedStmt *pstmt, const char *queryString, \
+	ProcessUtilityContext context, ParamListInfo params, QueryEnvironment *queryEnv, \
+	DestReceiver *dest, QueryCompletion *qc
+#define PROCESS_UTILITY_PARAMS pstmt, queryString, context, params, queryEnv, dest, qc
+#else
+#define PROCESS_UTILITY_ARGS PlannedStmt *pstmt, const char *queryString, \
+	ProcessUtilityContext context, ParamListInfo params, QueryEnvironment *queryEnv, \
+	DestReceiver *dest, char *completionTag
+#define PROCESS_UTILITY_PARAMS pstmt, queryString, context, params, queryEnv, dest, completionTag
 #endif
 
 /* Hook function adresses */
 static PlannedStmt *magicplan_planner(HOOK_ARGS);
-static PlannedStmt *real_plan(magicplan_mutator_context *context);
+static PlannedStmt *magicplan_planner_internal(HOOK_ARGS);
+static PlannedStmt *real_plan(magicplan_search_context *context);
+static void magicplan_shmem_request(void);
+static void magicplan_shmem_startup(void);
+static void magicplan_ExecutorStart(QueryDesc *queryDesc, int eflags);
+static void magicplan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+								  uint64 count, bool execute_once);
+static void magicplan_ExecutorFinish(QueryDesc *queryDesc);
+static void magicplan_ExecutorEnd(QueryDesc *queryDesc);
+static void magicplan_ProcessUtility(PROCESS_UTILITY_ARGS);
+static void magicplan_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+									  ExplainState *es, const char *queryString,
+									  ParamListInfo params, QueryEnvironment *queryEnv);
 
 
 /*
@@ -66,10 +656,79 @@ static PlannedStmt *real_plan(magicplan_mutator_context *context);
 bool magicplan_enabled;
 double magicplan_threshold;
 double magicplan_ignore_cost_below;
+bool magicplan_adaptive;
+int magicplan_adaptive_reprobe;
+int magicplan_cache_size;
+int magicplan_stats_max;
+int magicplan_max_candidates;
+int magicplan_planning_budget;
+double magicplan_planning_budget_ratio;
+char *magicplan_sublink_types_string;
+int magicplan_sublink_types;
+bool magicplan_feedback;
+int magicplan_feedback_min_samples;
+int magicplan_negative_cache_size;
+int magicplan_negative_cache_losses;
+int magicplan_negative_cache_reprobe;
+int magicplan_sample_rate;
+bool magicplan_async_search;
+bool magicplan_save;
+int magicplan_async_queue_size;
+int magicplan_search_strategy;
+int magicplan_exhaustive_limit;
+int magicplan_beam_width;
+int magicplan_max_nesting_level;
+int magicplan_prepared_plans;
+int magicplan_fingerprint_mode;
+bool magicplan_prefilter;
+double magicplan_prefilter_min_gain;
+int magicplan_prefilter_top;
+double magicplan_parallel_availability;
+int magicplan_max_pins;
+int magicplan_log_min_search_duration;
+int magicplan_concurrent_search_wait;
+bool magicplan_wait_event;
+
 
+static bool check_sublink_types(char **newval, void **extra, GucSource source);
+static void assign_sublink_types(const char *newval, void *extra);
+bool magicplan_scan_walker (Node *node, magicplan_scan_context *context);
+static uint64 magicplan_fingerprint(Query *parse);
+static bool find_best_query(magicplan_search_context * context, uint64 fences, Cost *cost);
+void magicplan_probe_search_start(uint64 fingerprint, int nranked);
+void magicplan_probe_candidate(uint64 fingerprint, uint64 fences, double planning_time);
+void magicplan_probe_search_done(uint64 fingerprint, int candidates, uint64 fenced, double search_time);
+static bool magicplan_cache_lookup(uint64 fingerprint, magicplanCacheEntry *result);
+static void magicplan_cache_store(uint64 fingerprint, int nsublinks, uint64 fenced, uint64 fence_candidate,
+								  double candidate_ratio, uint64 same_cost, bool custom_plan,
+								  List *relationOids, uint64 signature);
+static uint64 magicplan_relation_signature(Oid relid);
+static uint64 magicplan_query_signature(magicplan_search_context *context);
+static uint64 magicplan_feedback_choice(magicplanCacheEntry *entry);
+static void magicplan_feedback_remember(uint64 queryid, uint64 fingerprint, uint64 fenced);
+static void magicplan_cache_remove(uint64 fingerprint);
+static void magicplan_cache_insert(const magicplanCacheEntry *decision);
+static void magicplan_cache_load(void);
+static void magicplan_shmem_shutdown(int code, Datum arg);
+static bool magicplan_negative_skip(uint64 fingerprint);
+static bool magicplan_negative_record(uint64 fingerprint, bool won);
+static bool magicplan_pin_lookup(uint64 fingerprint, magicplanPinSlot *result);
+static bool magicplan_pin_probe(uint64 fingerprint, magicplanPinSlot *result);
+static void magicplan_pins_load(void);
+static void magicplan_stats_record(uint64 fingerprint, bool cache_hit, bool searched,
+								   int candidates, bool won, double extra_time,
+								   Cost base_cost, Cost chosen_cost);
+static bool magicplan_stats_lookup(uint64 fingerprint, magicplanCounters *result);
+static void magicplan_stats_flush(void);
 
-Node* magicplan_mutator (Node *node, magicplan_mutator_context *context);
-bool find_best_query(magicplan_mutator_context * context, Query* a);
+PG_FUNCTION_INFO_V1(magicplan_stats);
+PG_FUNCTION_INFO_V1(magicplan_stats_reset);
+PG_FUNCTION_INFO_V1(magicplan_set_sample_rate);
+PG_FUNCTION_INFO_V1(magicplan_decisions);
+PG_FUNCTION_INFO_V1(magicplan_import_decision);
+PG_FUNCTION_INFO_V1(magicplan_pin);
+PG_FUNCTION_INFO_V1(magicplan_unpin);
+PG_FUNCTION_INFO_V1(magicplan_list_pins);
 
 void
 _PG_init(void)
@@ -77,6 +736,18 @@ _PG_init(void)
 	/* Install hooks. */
 	prev_planner = planner_hook;
 	planner_hook = magicplan_planner;
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = magicplan_ExecutorStart;
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = magicplan_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = magicplan_ExecutorFinish;
+	prev_ExecutorEnd = ExecutorEnd_hook;
+	ExecutorEnd_hook = magicplan_ExecutorEnd;
+	prev_ProcessUtility = ProcessUtility_hook;
+	ProcessUtility_hook = magicplan_ProcessUtility;
+	prev_ExplainOneQuery = ExplainOneQuery_hook;
+	ExplainOneQuery_hook = magicplan_ExplainOneQuery;
 
 	/* Setup guc */
 	DefineCustomBoolVariable("magicplan.enabled",
@@ -85,7 +756,7 @@ _PG_init(void)
 		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
 
 	DefineCustomRealVariable("magicplan.threshold",
-		"Threshold required to inject the OFFSET 0 in the query.", "The total_cost of old_plan / new_plan must be over this threshold for the new plan to be used.",
+		"Threshold required to inject the OFFSET 0 in the query.", "The cost of old_plan / new_plan must be over this threshold for the new plan to be used.",
 		&magicplan_threshold, 1.0 /* default */, 0.0 /* min */, 10000.0 /* max, to be confirmed */,
 		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
 
@@ -93,6 +764,184 @@ _PG_init(void)
 		"Threshold cost required to have magic plan do anything at all", "If the base query cost is below this threshold, don't to anything.",
 		&magicplan_ignore_cost_below, 2000.0 /* default */, 0.0 /* min */, 100000000.0 /* max, to be confirmed */,
 		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomBoolVariable("magicplan.adaptive",
+		"Sets whether the searches are weighed against their expected savings.", "Queries searched before are only searched again when the savings learned from the statistics exceed the expected planning overhead, and the threshold follows the measured execution times. Needs the statistics.",
+		&magicplan_adaptive, false /* default */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.adaptive_reprobe",
+		"Average number of planner calls after which magicplan.adaptive searches a query its savings rule out.", "This lets a change in the data flip the decision. 0 means never.",
+		&magicplan_adaptive_reprobe, 100 /* default */, 0 /* min */, INT_MAX /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomStringVariable("magicplan.sublink_types",
+		"Kinds of sublinks in which an OFFSET 0 can be injected.", "Comma-separated list of exists, not_exists, any (for IN (SELECT ...)), cte (materializing a CTE the planner would inline, PG12+) and subquery (subqueries in FROM).",
+		&magicplan_sublink_types_string, "exists, not_exists" /* default */,
+		PGC_USERSET, GUC_LIST_INPUT /* flags */, check_sublink_types /* check_hook */, assign_sublink_types /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomEnumVariable("magicplan.search_strategy",
+		"Sets how the combinations of OFFSET 0 placements are explored.", "greedy plans one candidate per sublink, exhaustive tries every combination of the sublinks that matter, beam keeps the magicplan.beam_width best combinations at each step.",
+		&magicplan_search_strategy, MAGICPLAN_SEARCH_GREEDY /* default */, search_strategy_options,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.exhaustive_limit",
+		"Maximum number of sublinks for an exhaustive search.", "Above this, the exhaustive strategy falls back to a beam search.",
+		&magicplan_exhaustive_limit, 5 /* default */, 1 /* min */, 10 /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.beam_width",
+		"Number of combinations kept at each step of a beam search.", NULL /* long desc */,
+		&magicplan_beam_width, 3 /* default */, 1 /* min */, MAGICPLAN_MAX_BEAM_WIDTH /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomBoolVariable("magicplan.prefilter",
+		"Sets whether the sublinks are ranked on statistics before being searched.", "Sublinks the planner never pulls up are skipped, and the others are searched by decreasing estimated gain.",
+		&magicplan_prefilter, true /* default */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomRealVariable("magicplan.prefilter_min_gain",
+		"Sets the estimated gain below which the prefilter skips a sublink.", "The gain is the size of the subquery relations divided by the estimated cost of probing them once per row of the outer relations they are correlated with. 0 keeps all the sublinks.",
+		&magicplan_prefilter_min_gain, 0.01 /* default */, 0.0 /* min */, 1000000.0 /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.prefilter_top",
+		"Sets the number of best ranked sublinks kept by the prefilter.", "0 means no limit.",
+		&magicplan_prefilter_top, 0 /* default */, 0 /* min */, MAGICPLAN_MAX_SUBLINKS /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomRealVariable("magicplan.parallel_availability",
+		"Sets the fraction of the planned parallel workers expected to be launched.", "Plans with a Gather or Gather Merge are compared as if only this fraction of their workers ran. 1 trusts the planner, 0 compares them as if they ran in the leader alone.",
+		&magicplan_parallel_availability, 1.0 /* default */, 0.0 /* min */, 1.0 /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.max_candidates",
+		"Maximum number of candidate plans made for a query.", "Once reached, the best plan found so far is used. 0 means no limit.",
+		&magicplan_max_candidates, 0 /* default */, 0 /* min */, MAGICPLAN_MAX_SUBLINKS /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.planning_budget_ms",
+		"Maximum extra planning time magicplan can spend on a query.", "Once reached, the best plan found so far is used. 0 means no limit.",
+		&magicplan_planning_budget, 0 /* default */, 0 /* min */, INT_MAX /* max */,
+		PGC_USERSET, GUC_UNIT_MS /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomRealVariable("magicplan.planning_budget_ratio",
+		"Maximum extra planning time, relative to the planning time of the pristine query.", "Once reached, the best plan found so far is used. 0 means no limit.",
+		&magicplan_planning_budget_ratio, 0.0 /* default */, 0.0 /* min */, 10000.0 /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.log_min_search_duration",
+		"Sets the minimum search time above which the search is logged.", "The log gives the planning time of the pristine query and of each candidate. -1 disables it, 0 logs every search.",
+		&magicplan_log_min_search_duration, -1 /* default */, -1 /* min */, INT_MAX /* max */,
+		PGC_SUSET, GUC_UNIT_MS /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomBoolVariable("magicplan.wait_event",
+		"Sets whether the planning of the candidates is reported as a wait event.", "The Extension wait event shows in pg_stat_activity while a candidate is planned, unless the planner waits on something else meanwhile.",
+		&magicplan_wait_event, false /* default */,
+		PGC_SUSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomBoolVariable("magicplan.feedback",
+		"Sets whether cached decisions follow the measured execution times.", "Both the pristine and the OFFSET 0 variants of a cached query are timed, and the fastest one is used. Needs the decision cache, and the query identifiers to match the executions with their plan.",
+		&magicplan_feedback, false /* default */,
+		PGC_SUSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.feedback_min_samples",
+		"Number of timed executions of each variant needed before preferring the fastest one.", NULL /* long desc */,
+		&magicplan_feedback_min_samples, 10 /* default */, 1 /* min */, INT_MAX /* max */,
+		PGC_SUSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.sample_rate",
+		"Search again a cached query once every this many planner calls.", "The other calls use the cached decision. 0 means never, the cached decision is then always used.",
+		&magicplan_sample_rate, 0 /* default */, 0 /* min */, INT_MAX /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.max_nesting_level",
+		"Sets the deepest nesting level at which queries are searched.", "Queries run by functions, triggers or DO blocks are nested. 0 only searches the top-level statements, -1 means no limit. Cached decisions are still used at any level.",
+		&magicplan_max_nesting_level, -1 /* default */, -1 /* min */, INT_MAX /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomEnumVariable("magicplan.fingerprint",
+		"Sets how the queries are identified in the caches and the statistics.", "query_id uses the query identifier, structural a hash of the query ignoring its constants, and auto the query identifier when it is computed, else the hash.",
+		&magicplan_fingerprint_mode, MAGICPLAN_FINGERPRINT_AUTO /* default */, fingerprint_options,
+		PGC_SUSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomEnumVariable("magicplan.prepared_plans",
+		"Sets which plans of the prepared statements are searched.", "The other plans only use the cached decision: with generic, the custom plans reuse the decision of the generic plan. Until the generic plan has searched the query, the custom plans are searched like with all, and the generic plan searches it again once. Statements that never get the searched kind of plan, because of plan_cache_mode or cursor options, have all their plans searched.",
+		&magicplan_prepared_plans, MAGICPLAN_PREPARED_ALL /* default */, prepared_plans_options,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomBoolVariable("magicplan.async_search",
+		"Sets whether the searches are left to background workers.", "The pristine plan is used right away, and the decision found by the worker is used by the next executions. Needs the decision cache and PG13 or later.",
+		&magicplan_async_search, false /* default */,
+		PGC_SUSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.concurrent_search_wait_ms",
+		"Sets how long a query waits for the search of the same query by another backend.", "The decision of that search is used if it ends in time, else the pristine plan. 0 uses the pristine plan right away. Needs the decision cache.",
+		&magicplan_concurrent_search_wait, 0 /* default */, 0 /* min */, 10000 /* max */,
+		PGC_USERSET, GUC_UNIT_MS /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.async_queue_size",
+		"Number of searches that can wait for a background worker.", "Set to 0 to disable the background searches. Requires magicplan in shared_preload_libraries.",
+		&magicplan_async_queue_size, 16 /* default */, 0 /* min */, 1024 /* max */,
+		PGC_POSTMASTER, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.cache_size",
+		"Number of query decisions kept in the shared decision cache.", "Set to 0 to disable the cache. Requires magicplan in shared_preload_libraries.",
+		&magicplan_cache_size, 1000 /* default */, 0 /* min */, 1000000 /* max */,
+		PGC_POSTMASTER, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomBoolVariable("magicplan.save",
+		"Save the decision cache across server shutdowns.", NULL /* long desc */,
+		&magicplan_save, true /* default */,
+		PGC_SIGHUP, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.negative_cache_size",
+		"Number of slots of the shared negative cache.", "The negative cache remembers the queries whose searches never found a better plan. Set to 0 to disable it. Requires magicplan in shared_preload_libraries.",
+		&magicplan_negative_cache_size, 4096 /* default */, 0 /* min */, 1000000 /* max */,
+		PGC_POSTMASTER, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.negative_cache_losses",
+		"Number of searches in a row keeping the pristine plan after which a query is no longer searched.", NULL /* long desc */,
+		&magicplan_negative_cache_losses, 3 /* default */, 1 /* min */, INT_MAX /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.negative_cache_reprobe",
+		"Number of skipped searches after which a query of the negative cache is searched again.", "This lets a change in the data flip the decision. 0 means never.",
+		&magicplan_negative_cache_reprobe, 100 /* default */, 0 /* min */, INT_MAX /* max */,
+		PGC_USERSET, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.max_pins",
+		"Number of query fingerprints that can be pinned with magicplan_pin.", "Set to 0 to disable the pins. Requires magicplan in shared_preload_libraries.",
+		&magicplan_max_pins, 100 /* default */, 0 /* min */, 100000 /* max */,
+		PGC_POSTMASTER, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	DefineCustomIntVariable("magicplan.stats_max",
+		"Number of query fingerprints tracked in pg_stat_magicplan.", "Set to 0 to disable the statistics. Requires magicplan in shared_preload_libraries.",
+		&magicplan_stats_max, 1000 /* default */, 0 /* min */, 1000000 /* max */,
+		PGC_POSTMASTER, 0 /* flags */, NULL /* check_hook */, NULL /* assign_hook */, NULL /* show_hook */);
+
+	/*
+	 * The shared memory can only be requested when loaded through
+	 * shared_preload_libraries. Otherwise, the planner hook still works, but
+	 * without the decision cache and the statistics.
+	 */
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+#if PG_VERSION_NUM >= 140000
+	/* The executions are matched with their plan through the query
+	 * identifier, have it computed with compute_query_id = auto */
+	EnableQueryId();
+#endif
+
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = magicplan_shmem_request;
+#else
+	magicplan_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = magicplan_shmem_startup;
 }
 
 void
@@ -100,152 +949,4296 @@ _PG_fini(void)
 {
 	/* Uninstall hooks. */
 	planner_hook = prev_planner;
+	ExecutorStart_hook = prev_ExecutorStart;
+	ExecutorRun_hook = prev_ExecutorRun;
+	ExecutorFinish_hook = prev_ExecutorFinish;
+	ExecutorEnd_hook = prev_ExecutorEnd;
+	ProcessUtility_hook = prev_ProcessUtility;
+	ExplainOneQuery_hook = prev_ExplainOneQuery;
+	shmem_startup_hook = prev_shmem_startup_hook;
+#if PG_VERSION_NUM >= 150000
+	shmem_request_hook = prev_shmem_request_hook;
+#endif
 }
 
-static PlannedStmt *
-real_plan(magicplan_mutator_context *context)
+/*
+ * Parse magicplan.sublink_types into a MAGICPLAN_SUBLINK_* mask.
+ */
+static bool
+check_sublink_types(char **newval, void **extra, GucSource source)
 {
-	if (prev_planner)
-		return prev_planner(HOOK_PARAMS(context));
-	else
-		return standard_planner(HOOK_PARAMS(context));
+	char *rawstring;
+	List *elemlist;
+	ListCell *l;
+	int types = 0;
+	int *myextra;
+
+	rawstring = pstrdup(*newval);
+	if (!SplitIdentifierString(rawstring, ',', &elemlist))
+	{
+		GUC_check_errdetail("List syntax is invalid.");
+		pfree(rawstring);
+		list_free(elemlist);
+		return false;
+	}
+
+	foreach(l, elemlist)
+	{
+		char *tok = (char *) lfirst(l);
+
+		if (pg_strcasecmp(tok, "exists") == 0)
+			types |= MAGICPLAN_SUBLINK_EXISTS;
+		else if (pg_strcasecmp(tok, "not_exists") == 0)
+			types |= MAGICPLAN_SUBLINK_NOT_EXISTS;
+		else if (pg_strcasecmp(tok, "any") == 0)
+			types |= MAGICPLAN_SUBLINK_ANY;
+		else if (pg_strcasecmp(tok, "cte") == 0)
+			types |= MAGICPLAN_SUBLINK_CTE;
+		else if (pg_strcasecmp(tok, "subquery") == 0)
+			types |= MAGICPLAN_SUBLINK_SUBQUERY;
+		else
+		{
+			GUC_check_errdetail("Unrecognized sublink type: \"%s\".", tok);
+			pfree(rawstring);
+			list_free(elemlist);
+			return false;
+		}
+	}
+
+	pfree(rawstring);
+	list_free(elemlist);
+
+	myextra = (int *) malloc(sizeof(int));
+	if (!myextra)
+		return false;
+	*myextra = types;
+	*extra = myextra;
+	return true;
+}
+
+static void
+assign_sublink_types(const char *newval, void *extra)
+{
+	magicplan_sublink_types = *((int *) extra);
 }
 
 /*
- * Compare the plan for a given query with the current best_plan,
- * and store the result in the mutator_context
+ * Request the shared memory and the lock for the decision cache.
+ * Since PG15, this must be done from the shmem_request_hook.
  */
-bool
-find_best_query(magicplan_mutator_context * context, Query* candidate)
+static void
+magicplan_shmem_request(void)
 {
-	Query * previous_context_query = context->current_query;
-	PlannedStmt *candidate_plan;
-	/* We always need to copy the query before planning it, because the planner
-	 * will change the query (replacing sublinks by subplans, among other
-	 * things)
-	 */
-	context->current_query = copyObject(candidate);
-	candidate_plan = real_plan(context);
-	context->current_query = previous_context_query;
-	/* Only keep the mutation if it's worthwile. */
-	if (context->best_plan == NULL ||
-	   (candidate_plan->planTree->total_cost <= context->best_plan->planTree->total_cost))
-	{
-		context->best_plan = candidate_plan;
-		context->best_query = candidate;
-		return true;
-	}
-	return false;
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+	RequestAddinShmemSpace(add_size(add_size(add_size(MAXALIGN(sizeof(magicplanSharedState)),
+													  mul_size(MAGICPLAN_NUM_PARTITIONS,
+															   hash_estimate_size(MAGICPLAN_PARTITION_SIZE(magicplan_cache_size),
+																				  sizeof(magicplanCacheEntry)))),
+											 mul_size(MAGICPLAN_NUM_PARTITIONS,
+													  hash_estimate_size(MAGICPLAN_PARTITION_SIZE(magicplan_stats_max),
+																		 sizeof(magicplanStatsEntry)))),
+									mul_size(magicplan_negative_cache_size, sizeof(magicplanNegativeSlot))));
+	RequestAddinShmemSpace(mul_size(magicplan_async_queue_size, ASYNC_SLOT_SIZE()));
+	RequestAddinShmemSpace(mul_size(MAGICPLAN_PIN_SLOTS(), sizeof(magicplanPinSlot)));
+	RequestAddinShmemSpace(mul_size(MAGICPLAN_FLIGHT_SLOTS, sizeof(magicplanFlightSlot)));
+	RequestNamedLWLockTranche("magicplan", 2 * MAGICPLAN_NUM_PARTITIONS + 1);
 }
 
 /*
- * Callback  for the expression_tree_mutator, query_tree_mutator functions.
- * We don't care about most nodes except for queries, which we recurse into,
- * and EXISTS(SELECT ..) nodes (Sublink of type EXISTS_SUBLINK).
- * In the latter case, we try to inject an OFFSET 0 to the query,
- * and replan the whole query to see if we have an improvement.
- * If it improves the query, store it in the context.
+ * Allocate or attach to the shared state and the decision cache.
  */
-Node*
-magicplan_mutator (Node *node, magicplan_mutator_context *context)
+static void
+magicplan_shmem_startup(void)
 {
-	if (node == NULL)
-		return NULL;
+	bool found;
+	bool first_time;
+	HASHCTL info;
+	int i;
 
-	/*
-	 * expression_tree_mutator doesn't recurse into queries, we have to do it
-	 * ourselves through a call to query_tree_mutator
-	 */
-	if (IsA(node, Query))
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	magicplan_state = NULL;
+	memset(magicplan_cache, 0, sizeof(magicplan_cache));
+	memset(magicplan_stats_hash, 0, sizeof(magicplan_stats_hash));
+	magicplan_negative_cache = NULL;
+	magicplan_async_queue = NULL;
+	magicplan_pins = NULL;
+	magicplan_flights = NULL;
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	magicplan_state = ShmemInitStruct("magicplan", sizeof(magicplanSharedState), &found);
+	first_time = !found;
+	if (!found)
 	{
-		return (Node*) query_tree_mutator((Query*) node, magicplan_mutator, context, 0);
+		LWLockPadded *locks = GetNamedLWLockTranche("magicplan");
+
+		for (i = 0; i < MAGICPLAN_NUM_PARTITIONS; i++)
+		{
+			magicplan_state->cache_locks[i] = &locks[i].lock;
+			magicplan_state->stats_locks[i] = &locks[MAGICPLAN_NUM_PARTITIONS + i].lock;
+		}
+		magicplan_state->pins_lock = &locks[2 * MAGICPLAN_NUM_PARTITIONS].lock;
+		magicplan_state->npins = 0;
+		magicplan_state->nlive = 0;
+		magicplan_state->pins_changecount = 0;
+		for (i = 0; i < MAGICPLAN_NUM_PARTITIONS; i++)
+			magicplan_state->cache_changecounts[i] = 0;
 	}
-	/*
-	 * The interesting case: EXISTS (SELECT ...)
-	 */
-	if (IsA(node, SubLink))
+
+	for (i = 0; i < MAGICPLAN_NUM_PARTITIONS; i++)
 	{
-		SubLink * sublink = (SubLink*) node;
-		if ((sublink->subLinkType == EXISTS_SUBLINK) && (sublink->subselect->type == T_Query))
-		{
-			Query *newquery;
-			/* First, recurse into the subquery like we would normally do. This
-			 * is for the case of nested EXISTS() for example.*/
-			newquery = query_tree_mutator((Query*) sublink->subselect, magicplan_mutator, context, QTW_DONT_COPY_QUERY);
-			/* If the query do not have a limit or offset, add an OFFSET 0
-			 * clause */
-			if (newquery->limitOffset == NULL)
-			{
-				newquery->limitOffset = (Node *) makeConst(INT8OID,
-													  -1,
-													  InvalidOid,
-													  sizeof(int64),
-													  Int64GetDatum(0),
-													  false,
-													  true);
-				/* Plan the new query, and store the result.
-				 * We are always starting with the current best_query: this
-				 * means that individually worthwile OFFSET additions will stack
-				 * among the tree traversal.
-				 */
-				sublink->subselect = (Node *) newquery;
-				find_best_query(context, context->best_query);
-			}
-		}
-		return (Node *) sublink;
-	}
-	/* Default case: let expression_tree_mutator recurse into the tree */
-	return expression_tree_mutator(node, magicplan_mutator, context);
+		char name[SHMEM_INDEX_KEYSIZE];
+
+		if (magicplan_cache_size > 0)
+		{
+			long size = MAGICPLAN_PARTITION_SIZE(magicplan_cache_size);
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(uint64);
+			info.entrysize = sizeof(magicplanCacheEntry);
+			snprintf(name, sizeof(name), "magicplan decision cache %d", i);
+			magicplan_cache[i] = ShmemInitHash(name, size, size,
+											   &info, HASH_ELEM | HASH_BLOBS);
+		}
+
+		if (magicplan_stats_max > 0)
+		{
+			long size = MAGICPLAN_PARTITION_SIZE(magicplan_stats_max);
+
+			memset(&info, 0, sizeof(info));
+			info.keysize = sizeof(uint64);
+			info.entrysize = sizeof(magicplanStatsEntry);
+			snprintf(name, sizeof(name), "magicplan statistics %d", i);
+			magicplan_stats_hash[i] = ShmemInitHash(name, size, size,
+													&info, HASH_ELEM | HASH_BLOBS);
+		}
+	}
+
+	if (magicplan_negative_cache_size > 0)
+	{
+		magicplan_negative_cache = ShmemInitStruct("magicplan negative cache",
+												   mul_size(magicplan_negative_cache_size, sizeof(magicplanNegativeSlot)),
+												   &found);
+		if (!found)
+		{
+			for (i = 0; i < magicplan_negative_cache_size; i++)
+			{
+				magicplan_negative_cache[i].fingerprint = 0;
+				magicplan_negative_cache[i].losses = 0;
+				magicplan_negative_cache[i].skips = 0;
+				SpinLockInit(&magicplan_negative_cache[i].mutex);
+			}
+		}
+	}
+
+	/* Without the decision cache, there would be no decision to wait for */
+	if (magicplan_cache_size > 0)
+	{
+		magicplan_flights = ShmemInitStruct("magicplan searches in progress",
+											mul_size(MAGICPLAN_FLIGHT_SLOTS, sizeof(magicplanFlightSlot)),
+											&found);
+		if (!found)
+		{
+			for (i = 0; i < MAGICPLAN_FLIGHT_SLOTS; i++)
+			{
+				magicplan_flights[i].fingerprint = 0;
+				magicplan_flights[i].pid = 0;
+				SpinLockInit(&magicplan_flights[i].mutex);
+			}
+		}
+	}
+
+	if (magicplan_async_queue_size > 0)
+	{
+		magicplan_async_queue = ShmemInitStruct("magicplan async queue",
+												mul_size(magicplan_async_queue_size, ASYNC_SLOT_SIZE()),
+												&found);
+		if (!found)
+		{
+			for (i = 0; i < magicplan_async_queue_size; i++)
+			{
+				magicplanAsyncSlot *slot = ASYNC_SLOT(i);
+
+				SpinLockInit(&slot->mutex);
+				slot->state = MAGICPLAN_ASYNC_FREE;
+				slot->generation = 0;
+			}
+		}
+	}
+
+	if (magicplan_max_pins > 0)
+	{
+		magicplan_pins = ShmemInitStruct("magicplan pins",
+										 mul_size(MAGICPLAN_PIN_SLOTS(), sizeof(magicplanPinSlot)),
+										 &found);
+		if (!found)
+			memset(magicplan_pins, 0, mul_size(MAGICPLAN_PIN_SLOTS(), sizeof(magicplanPinSlot)));
+	}
+
+	LWLockRelease(AddinShmemInitLock);
+
+	/* The postmaster saves the decision cache when shutting down */
+	if (!IsUnderPostmaster)
+		on_shmem_exit(magicplan_shmem_shutdown, (Datum) 0);
+
+	if (first_time)
+	{
+		magicplan_cache_load();
+		magicplan_pins_load();
+	}
+}
+
+/*
+ * Load the decision cache saved at the last shutdown. The file is removed
+ * once loaded, so that a crash does not bring back outdated decisions.
+ */
+static void
+magicplan_cache_load(void)
+{
+	FILE *file;
+	uint32 header;
+	int32 pgver;
+	int32 entrysize;
+	int32 count;
+	int i;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE())
+		return;
+
+	file = AllocateFile(MAGICPLAN_DUMP_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(int32), 1, file) != 1 ||
+		fread(&entrysize, sizeof(int32), 1, file) != 1 ||
+		fread(&count, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	/* Decisions made by another major version or build are not loaded */
+	if (header != MAGICPLAN_FILE_HEADER || pgver != PG_VERSION_NUM / 100 ||
+		entrysize != sizeof(magicplanCacheEntry))
+		goto data_error;
+
+	for (i = 0; i < count; i++)
+	{
+		magicplanCacheEntry decision;
+
+		if (fread(&decision, sizeof(magicplanCacheEntry), 1, file) != 1)
+			goto read_error;
+		magicplan_cache_insert(&decision);
+	}
+
+	FreeFile(file);
+	unlink(MAGICPLAN_DUMP_FILE);
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m",
+					MAGICPLAN_DUMP_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"",
+					MAGICPLAN_DUMP_FILE)));
+fail:
+	if (file)
+		FreeFile(file);
+	unlink(MAGICPLAN_DUMP_FILE);
+}
+
+/*
+ * on_shmem_exit callback of the postmaster, saving the decision cache. This
+ * is not done after a crash, the cache could be corrupted.
+ */
+static void
+magicplan_shmem_shutdown(int code, Datum arg)
+{
+	FILE *file;
+	HASH_SEQ_STATUS status;
+	magicplanCacheEntry *entry;
+	int32 pgver = PG_VERSION_NUM / 100;
+	int32 entrysize = sizeof(magicplanCacheEntry);
+	int32 count = 0;
+	int i;
+
+	if (code || !magicplan_state || !MAGICPLAN_CACHE_AVAILABLE() || !magicplan_save)
+		return;
+
+	file = AllocateFile(MAGICPLAN_DUMP_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	for (i = 0; i < MAGICPLAN_NUM_PARTITIONS; i++)
+		count += hash_get_num_entries(magicplan_cache[i]);
+	if (fwrite(&MAGICPLAN_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&pgver, sizeof(int32), 1, file) != 1 ||
+		fwrite(&entrysize, sizeof(int32), 1, file) != 1 ||
+		fwrite(&count, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	for (i = 0; i < MAGICPLAN_NUM_PARTITIONS; i++)
+	{
+		hash_seq_init(&status, magicplan_cache[i]);
+		while ((entry = (magicplanCacheEntry *) hash_seq_search(&status)) != NULL)
+		{
+			if (fwrite(entry, sizeof(magicplanCacheEntry), 1, file) != 1)
+			{
+				hash_seq_term(&status);
+				goto error;
+			}
+		}
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(MAGICPLAN_DUMP_FILE ".tmp", MAGICPLAN_DUMP_FILE, LOG);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					MAGICPLAN_DUMP_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(MAGICPLAN_DUMP_FILE ".tmp");
+}
+
+/*
+ * Copy a decision cache entry without taking its spinlock. The caller must
+ * hold the partition lock, so that the entry does not go away, or check the
+ * change counter of the partition afterwards.
+ */
+static void
+magicplan_cache_read(volatile magicplanCacheEntry *entry, magicplanCacheEntry *result)
+{
+	for (;;)
+	{
+		uint32 before,
+			   after;
+
+		before = entry->changecount;
+		pg_read_barrier();
+		memcpy(result, (const magicplanCacheEntry *) entry, sizeof(magicplanCacheEntry));
+		pg_read_barrier();
+		after = entry->changecount;
+		if (before == after && (before & 1) == 0)
+			break;
+		SPIN_DELAY();
+	}
+}
+
+/*
+ * Look for a stored decision for the given query fingerprint.
+ * Returns true and fills result with a copy of the entry on a cache hit.
+ * The partition is searched without its lock: the entries of a shared hash
+ * table are never freed, only put back on its free list, so a search racing
+ * with a change of the partition reads stale but valid memory, and is done
+ * again once the change counter of the partition shows it. The lock is only
+ * taken when the partition keeps changing, and to refresh the LRU timestamp.
+ */
+static bool
+magicplan_cache_lookup(uint64 fingerprint, magicplanCacheEntry *result)
+{
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+	volatile uint32 *changecount;
+	TimestampTz now = GetCurrentStatementStartTimestamp();
+	magicplanCacheEntry *entry;
+	bool found = false;
+	bool done = false;
+	int tries;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE() || fingerprint == 0)
+		return false;
+
+	changecount = &magicplan_state->cache_changecounts[partition];
+	for (tries = 0; tries < MAGICPLAN_CACHE_READ_TRIES && !done; tries++)
+	{
+		uint32 before,
+			   after;
+
+		before = *changecount;
+		pg_read_barrier();
+		if ((before & 1) == 0)
+		{
+			entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_FIND, NULL);
+			if (entry)
+				magicplan_cache_read(entry, result);
+			pg_read_barrier();
+			after = *changecount;
+			if (before == after)
+			{
+				found = entry != NULL && result->fingerprint == fingerprint;
+				done = true;
+			}
+		}
+		if (!done)
+			SPIN_DELAY();
+	}
+	if (done && !(found && TimestampDifferenceExceeds(result->last_used, now, MAGICPLAN_LAST_USED_PRECISION_MS)))
+		return found;
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_SHARED);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_FIND, NULL);
+	if (entry)
+	{
+		magicplan_cache_read(entry, result);
+		if (TimestampDifferenceExceeds(result->last_used, now, MAGICPLAN_LAST_USED_PRECISION_MS))
+		{
+			MAGICPLAN_ENTRY_BEGIN_WRITE(entry);
+			entry->last_used = now;
+			MAGICPLAN_ENTRY_END_WRITE(entry);
+		}
+	}
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+	return entry != NULL;
+}
+
+/*
+ * Remove the least recently used entry of a decision cache partition, stale
+ * entries first. Caller must hold the partition lock in exclusive mode, and
+ * have made its change counter odd.
+ */
+static void
+magicplan_cache_evict(int partition)
+{
+	HASH_SEQ_STATUS status;
+	magicplanCacheEntry *entry;
+	magicplanCacheEntry *victim = NULL;
+
+	hash_seq_init(&status, magicplan_cache[partition]);
+	while ((entry = (magicplanCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (victim == NULL || (entry->stale && !victim->stale) ||
+			(entry->stale == victim->stale && entry->last_used < victim->last_used))
+			victim = entry;
+	}
+	if (victim)
+		hash_search(magicplan_cache[partition], &victim->fingerprint, HASH_REMOVE, NULL);
+}
+
+/*
+ * Whether a planner call that found its decision in the cache should search
+ * again, with a probability of 1 / sample_rate. Counting the calls in the
+ * shared entry would have every backend write to it.
+ */
+static bool
+magicplan_sample(int sample_rate)
+{
+#if PG_VERSION_NUM >= 150000
+	return pg_prng_uint64_range(&pg_global_prng_state, 1, sample_rate) == 1;
+#else
+	return random() % sample_rate == 0;
+#endif
+}
+
+/*
+ * Store the decision taken for a query fingerprint, evicting the least
+ * recently used one if needed. The execution feedback is kept as long as the
+ * best OFFSET 0 placement does not change.
+ * same_cost are the sublinks whose OFFSET 0 alone did not change the cost,
+ * the next sampled searches skip them. custom_plan tells the decision was searched
+ * with bound parameters, see magicplan.prepared_plans.
+ * relationOids are the relations the plan depends on, and signature their
+ * state, see magicplan_plan_signature: the decision is searched again once
+ * it changes.
+ */
+static void
+magicplan_cache_store(uint64 fingerprint, int nsublinks, uint64 fenced, uint64 fence_candidate,
+					  double candidate_ratio, uint64 same_cost, bool custom_plan,
+					  List *relationOids, uint64 signature)
+{
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+	magicplanCacheEntry *entry;
+	bool found;
+	ListCell *lc;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE() || fingerprint == 0)
+		return;
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_EXCLUSIVE);
+	MAGICPLAN_PARTITION_BEGIN_WRITE(partition);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_FIND, NULL);
+	if (!entry)
+	{
+		if (hash_get_num_entries(magicplan_cache[partition]) >= MAGICPLAN_PARTITION_SIZE(magicplan_cache_size))
+			magicplan_cache_evict(partition);
+		entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_ENTER, &found);
+		SpinLockInit(&entry->mutex);
+		entry->changecount = 0;
+		entry->sample_rate = -1;
+		entry->fence_candidate = 0;
+		entry->pristine_runs = 0;
+		entry->pristine_time = 0.0;
+	}
+	if (entry->fence_candidate != fence_candidate)
+	{
+		entry->fenced_runs = 0;
+		entry->fenced_time = 0.0;
+	}
+	entry->nsublinks = nsublinks;
+	entry->fenced = fenced;
+	entry->fence_candidate = fence_candidate;
+	entry->candidate_ratio = candidate_ratio;
+	entry->same_cost = same_cost;
+	entry->custom_plan = custom_plan;
+	entry->stale = false;
+	entry->signature = signature;
+	entry->last_used = GetCurrentStatementStartTimestamp();
+	entry->nrelids = 0;
+	foreach(lc, relationOids)
+	{
+		if (entry->nrelids == MAGICPLAN_MAX_RELIDS)
+		{
+			entry->nrelids = -1;
+			break;
+		}
+		entry->relids[entry->nrelids++] = lfirst_oid(lc);
+	}
+	MAGICPLAN_PARTITION_END_WRITE(partition);
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+}
+
+/*
+ * Mark the decision stored for a query fingerprint as stale, the planner
+ * found that the relations it depends on changed since it was stored. This
+ * only matters for the eviction and the export, the planner checks the
+ * relations at each lookup. An entry stored meanwhile for the new state of
+ * the relations is left alone.
+ */
+static void
+magicplan_cache_mark_stale(uint64 fingerprint, uint64 signature)
+{
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+	magicplanCacheEntry *entry;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE() || fingerprint == 0)
+		return;
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_SHARED);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_FIND, NULL);
+	if (entry && entry->signature == signature && !entry->stale)
+	{
+		MAGICPLAN_ENTRY_BEGIN_WRITE(entry);
+		entry->stale = true;
+		MAGICPLAN_ENTRY_END_WRITE(entry);
+	}
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+}
+
+/*
+ * Insert a whole decision in the cache, replacing the one stored for the
+ * same fingerprint, if any. This is used to load saved and imported
+ * decisions.
+ */
+static void
+magicplan_cache_insert(const magicplanCacheEntry *decision)
+{
+	int partition = MAGICPLAN_PARTITION(decision->fingerprint);
+	magicplanCacheEntry *entry;
+	bool found;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE() || decision->fingerprint == 0)
+		return;
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_EXCLUSIVE);
+	MAGICPLAN_PARTITION_BEGIN_WRITE(partition);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &decision->fingerprint, HASH_FIND, NULL);
+	if (!entry && hash_get_num_entries(magicplan_cache[partition]) >= MAGICPLAN_PARTITION_SIZE(magicplan_cache_size))
+		magicplan_cache_evict(partition);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &decision->fingerprint, HASH_ENTER, &found);
+	*entry = *decision;
+	SpinLockInit(&entry->mutex);
+	entry->changecount = 0;
+	MAGICPLAN_PARTITION_END_WRITE(partition);
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+}
+
+/*
+ * Forget the decision stored for a query fingerprint.
+ */
+static void
+magicplan_cache_remove(uint64 fingerprint)
+{
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+
+	if (!MAGICPLAN_CACHE_AVAILABLE() || fingerprint == 0)
+		return;
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_EXCLUSIVE);
+	MAGICPLAN_PARTITION_BEGIN_WRITE(partition);
+	hash_search(magicplan_cache[partition], &fingerprint, HASH_REMOVE, NULL);
+	MAGICPLAN_PARTITION_END_WRITE(partition);
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+}
+
+/*
+ * Check whether the search can be skipped for a query fingerprint, because
+ * its last magicplan.negative_cache_losses searches all kept the pristine
+ * plan. Every magicplan.negative_cache_reprobe skips, the search is done
+ * anyway.
+ */
+static bool
+magicplan_negative_skip(uint64 fingerprint)
+{
+	magicplanNegativeSlot *slot;
+	bool skip = false;
+
+	if (!magicplan_negative_cache || fingerprint == 0)
+		return false;
+
+	slot = &magicplan_negative_cache[fingerprint % magicplan_negative_cache_size];
+	SpinLockAcquire(&slot->mutex);
+	if (slot->fingerprint == fingerprint && slot->losses >= magicplan_negative_cache_losses)
+	{
+		if (magicplan_negative_cache_reprobe > 0 && slot->skips >= magicplan_negative_cache_reprobe)
+			slot->skips = 0;
+		else
+		{
+			slot->skips++;
+			skip = true;
+		}
+	}
+	SpinLockRelease(&slot->mutex);
+	return skip;
+}
+
+/*
+ * Record the outcome of a search in the negative cache. A win clears the
+ * slot of the query. Returns true if the query is now skipped.
+ */
+static bool
+magicplan_negative_record(uint64 fingerprint, bool won)
+{
+	magicplanNegativeSlot *slot;
+	bool skipped;
+
+	if (!magicplan_negative_cache || fingerprint == 0)
+		return false;
+
+	slot = &magicplan_negative_cache[fingerprint % magicplan_negative_cache_size];
+	SpinLockAcquire(&slot->mutex);
+	if (slot->fingerprint != fingerprint)
+	{
+		if (won)
+		{
+			SpinLockRelease(&slot->mutex);
+			return false;
+		}
+		slot->fingerprint = fingerprint;
+		slot->losses = 0;
+		slot->skips = 0;
+	}
+	if (won)
+		slot->fingerprint = 0;
+	else if (slot->losses < PG_UINT32_MAX)
+		slot->losses++;
+	skipped = !won && slot->losses >= magicplan_negative_cache_losses;
+	SpinLockRelease(&slot->mutex);
+	return skipped;
+}
+
+/*
+ * before_shmem_exit callback, releasing the searches of a backend that exits
+ * in the middle of them.
+ */
+static void
+magicplan_flight_exit(int code, Datum arg)
+{
+	int i;
+
+	for (i = 0; i < MAGICPLAN_FLIGHT_SLOTS; i++)
+	{
+		magicplanFlightSlot *slot = &magicplan_flights[i];
+
+		SpinLockAcquire(&slot->mutex);
+		if (slot->pid == MyProcPid)
+		{
+			slot->fingerprint = 0;
+			slot->pid = 0;
+		}
+		SpinLockRelease(&slot->mutex);
+	}
+}
+
+/*
+ * Mark the search of a query fingerprint as in progress. Returns the slot to
+ * release once the decision is stored, or -1 when the slot is taken, *busy
+ * being set if that is by another backend searching the same query.
+ */
+static int
+magicplan_flight_claim(uint64 fingerprint, bool *busy)
+{
+	static bool exit_registered = false;
+	magicplanFlightSlot *slot;
+	int index = -1;
+
+	*busy = false;
+	if (!magicplan_flights || fingerprint == 0)
+		return -1;
+
+	if (!exit_registered)
+	{
+		before_shmem_exit(magicplan_flight_exit, (Datum) 0);
+		exit_registered = true;
+	}
+
+	slot = &magicplan_flights[fingerprint % MAGICPLAN_FLIGHT_SLOTS];
+	SpinLockAcquire(&slot->mutex);
+	if (slot->fingerprint == 0)
+	{
+		slot->fingerprint = fingerprint;
+		slot->pid = MyProcPid;
+		index = fingerprint % MAGICPLAN_FLIGHT_SLOTS;
+	}
+	else if (slot->fingerprint == fingerprint && slot->pid != MyProcPid)
+		*busy = true;
+	SpinLockRelease(&slot->mutex);
+	return index;
+}
+
+/*
+ * Release a slot taken by magicplan_flight_claim.
+ */
+static void
+magicplan_flight_release(int index)
+{
+	magicplanFlightSlot *slot;
+
+	if (index < 0)
+		return;
+
+	slot = &magicplan_flights[index];
+	SpinLockAcquire(&slot->mutex);
+	if (slot->pid == MyProcPid)
+	{
+		slot->fingerprint = 0;
+		slot->pid = 0;
+	}
+	SpinLockRelease(&slot->mutex);
+}
+
+/*
+ * Wait up to timeout ms for the search of a query fingerprint by another
+ * backend to end. Returns true if it did.
+ */
+static bool
+magicplan_flight_wait(uint64 fingerprint, int timeout)
+{
+	magicplanFlightSlot *slot = &magicplan_flights[fingerprint % MAGICPLAN_FLIGHT_SLOTS];
+	instr_time start_time,
+			   now;
+	bool done;
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	pgstat_report_wait_start(PG_WAIT_EXTENSION);
+	for (;;)
+	{
+		SpinLockAcquire(&slot->mutex);
+		done = slot->fingerprint != fingerprint;
+		SpinLockRelease(&slot->mutex);
+		if (done)
+			break;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, start_time);
+		if (INSTR_TIME_GET_MILLISEC(now) >= timeout)
+			break;
+		pg_usleep(1000L);
+		CHECK_FOR_INTERRUPTS();
+	}
+	pgstat_report_wait_end();
+	return done;
+}
+
+/*
+ * Look for the pin of a query fingerprint, without taking any lock: each slot
+ * is read again until its change counter shows a stable, complete copy, and
+ * the whole probe again if the slots were rehashed meanwhile.
+ */
+static bool
+magicplan_pin_lookup(uint64 fingerprint, magicplanPinSlot *result)
+{
+	volatile magicplanSharedState *state = magicplan_state;
+	uint32 before,
+		   after;
+	bool found;
+
+	if (!magicplan_pins || fingerprint == 0)
+		return false;
+
+	for (;;)
+	{
+		before = state->pins_changecount;
+		pg_read_barrier();
+		if ((before & 1) == 0)
+		{
+			found = magicplan_pin_probe(fingerprint, result);
+			pg_read_barrier();
+			after = state->pins_changecount;
+			if (before == after)
+				return found;
+		}
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Probe the pin slots for a fingerprint, see magicplan_pin_lookup
+ */
+static bool
+magicplan_pin_probe(uint64 fingerprint, magicplanPinSlot *result)
+{
+	int nslots = MAGICPLAN_PIN_SLOTS();
+	int start,
+		i;
+
+	start = (int) (fingerprint % (uint64) nslots);
+	for (i = 0; i < nslots; i++)
+	{
+		volatile magicplanPinSlot *slot = &magicplan_pins[(start + i) % nslots];
+		uint32 before,
+			   after;
+
+		for (;;)
+		{
+			before = slot->changecount;
+			pg_read_barrier();
+			result->fingerprint = slot->fingerprint;
+			result->fenced = slot->fenced;
+			result->mode = slot->mode;
+			pg_read_barrier();
+			after = slot->changecount;
+			if (before == after && (before & 1) == 0)
+				break;
+			CHECK_FOR_INTERRUPTS();
+		}
+
+		/* The probe sequence ends with a slot never used */
+		if (result->fingerprint == 0)
+			return false;
+		if (result->fingerprint == fingerprint)
+			return result->mode != MAGICPLAN_PIN_NONE;
+	}
+	return false;
+}
+
+/*
+ * Change a pin slot, for the lock-free readers. The caller must hold the pins
+ * lock exclusively.
+ */
+static void
+magicplan_pin_write(magicplanPinSlot *slot, uint64 fingerprint, uint64 fenced, int mode)
+{
+	slot->changecount++;
+	pg_write_barrier();
+	slot->fingerprint = fingerprint;
+	slot->fenced = fenced;
+	slot->mode = mode;
+	pg_write_barrier();
+	slot->changecount++;
+}
+
+/*
+ * Rehash the pinned fingerprints, dropping the unpinned slots. The lock-free
+ * readers wait for the change counter of the array to be even again, so the
+ * new slots are laid out in local memory first: nothing can fail while the
+ * counter is odd. The caller must hold the pins lock exclusively.
+ */
+static void
+magicplan_pins_rehash(void)
+{
+	int nslots = MAGICPLAN_PIN_SLOTS();
+	magicplanPinSlot *rehashed;
+	int nlive = 0;
+	int i;
+
+	rehashed = palloc0(sizeof(magicplanPinSlot) * nslots);
+	for (i = 0; i < nslots; i++)
+	{
+		int slot;
+
+		if (magicplan_pins[i].fingerprint == 0 || magicplan_pins[i].mode == MAGICPLAN_PIN_NONE)
+			continue;
+		slot = (int) (magicplan_pins[i].fingerprint % (uint64) nslots);
+		while (rehashed[slot].fingerprint != 0)
+			slot = (slot + 1) % nslots;
+		rehashed[slot] = magicplan_pins[i];
+		nlive++;
+	}
+	Assert(nlive == magicplan_state->nlive);
+
+	magicplan_state->pins_changecount++;
+	pg_write_barrier();
+	for (i = 0; i < nslots; i++)
+		magicplan_pin_write(&magicplan_pins[i], rehashed[i].fingerprint, rehashed[i].fenced, rehashed[i].mode);
+	magicplan_state->npins = nlive;
+	pg_write_barrier();
+	magicplan_state->pins_changecount++;
+
+	pfree(rehashed);
+	elog(DEBUG1, "magicplan - rehashed the pins, %d pinned fingerprints", nlive);
+}
+
+/*
+ * Store a pin, or remove it with MAGICPLAN_PIN_NONE. Returns false if
+ * magicplan.max_pins fingerprints are already pinned, or if the fingerprint
+ * to unpin is not pinned. The caller must hold the pins lock exclusively.
+ */
+static bool
+magicplan_pin_store(uint64 fingerprint, uint64 fenced, int mode)
+{
+	int nslots = MAGICPLAN_PIN_SLOTS();
+	int start = (int) (fingerprint % (uint64) nslots);
+	magicplanPinSlot *reusable = NULL;
+	int i;
+
+	for (i = 0; i < nslots; i++)
+	{
+		magicplanPinSlot *slot = &magicplan_pins[(start + i) % nslots];
+
+		if (slot->fingerprint == fingerprint)
+		{
+			if (slot->mode == MAGICPLAN_PIN_NONE && mode == MAGICPLAN_PIN_NONE)
+				return false;
+			if (slot->mode == MAGICPLAN_PIN_NONE)
+			{
+				if (magicplan_state->nlive >= magicplan_max_pins)
+					return false;
+				magicplan_state->nlive++;
+			}
+			else if (mode == MAGICPLAN_PIN_NONE)
+				magicplan_state->nlive--;
+			magicplan_pin_write(slot, fingerprint, fenced, mode);
+			return true;
+		}
+		if (slot->fingerprint != 0 && slot->mode == MAGICPLAN_PIN_NONE && reusable == NULL)
+			reusable = slot;
+		if (slot->fingerprint == 0)
+			break;
+	}
+
+	if (mode == MAGICPLAN_PIN_NONE || magicplan_state->nlive >= magicplan_max_pins)
+		return false;
+	if (reusable != NULL)
+	{
+		magicplan_pin_write(reusable, fingerprint, fenced, mode);
+		magicplan_state->nlive++;
+		return true;
+	}
+	/* Keep half of the slots unused, so that probing stays short: the
+	 * unpinned slots outside the probe sequence are dropped to make room */
+	if (i == nslots || magicplan_state->npins >= magicplan_max_pins)
+	{
+		magicplan_pins_rehash();
+		return magicplan_pin_store(fingerprint, fenced, mode);
+	}
+	magicplan_pin_write(&magicplan_pins[(start + i) % nslots], fingerprint, fenced, mode);
+	magicplan_state->npins++;
+	magicplan_state->nlive++;
+	return true;
+}
+
+/*
+ * Write the pins to their file, called after each change with the pins lock
+ * held exclusively. A failure leaves the pins in shared memory, they will only
+ * be lost at the next restart.
+ */
+static void
+magicplan_pins_save(void)
+{
+	FILE *file;
+	int32 pgver = PG_VERSION_NUM / 100;
+	int32 count = 0;
+	int i;
+
+	file = AllocateFile(MAGICPLAN_PINS_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	for (i = 0; i < MAGICPLAN_PIN_SLOTS(); i++)
+	{
+		if (magicplan_pins[i].fingerprint != 0 && magicplan_pins[i].mode != MAGICPLAN_PIN_NONE)
+			count++;
+	}
+	if (fwrite(&MAGICPLAN_PINS_FILE_HEADER, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&pgver, sizeof(int32), 1, file) != 1 ||
+		fwrite(&count, sizeof(int32), 1, file) != 1)
+		goto error;
+	for (i = 0; i < MAGICPLAN_PIN_SLOTS(); i++)
+	{
+		magicplanPinSlot *slot = &magicplan_pins[i];
+
+		if (slot->fingerprint == 0 || slot->mode == MAGICPLAN_PIN_NONE)
+			continue;
+		if (fwrite(&slot->fingerprint, sizeof(uint64), 1, file) != 1 ||
+			fwrite(&slot->fenced, sizeof(uint64), 1, file) != 1 ||
+			fwrite(&slot->mode, sizeof(int), 1, file) != 1)
+			goto error;
+	}
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+
+	(void) durable_rename(MAGICPLAN_PINS_FILE ".tmp", MAGICPLAN_PINS_FILE, WARNING);
+	return;
+
+error:
+	ereport(WARNING,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					MAGICPLAN_PINS_FILE ".tmp"),
+			 errdetail("The pins will be lost at the next restart.")));
+	if (file)
+		FreeFile(file);
+	unlink(MAGICPLAN_PINS_FILE ".tmp");
+}
+
+/*
+ * Load the pins saved by magicplan_pins_save. Pins of another major version
+ * are not loaded, query fingerprints change between major versions.
+ */
+static void
+magicplan_pins_load(void)
+{
+	FILE *file;
+	uint32 header;
+	int32 pgver;
+	int32 count;
+	int i;
+
+	if (!magicplan_pins)
+		return;
+
+	file = AllocateFile(MAGICPLAN_PINS_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			goto read_error;
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		fread(&pgver, sizeof(int32), 1, file) != 1 ||
+		fread(&count, sizeof(int32), 1, file) != 1)
+		goto read_error;
+
+	if (header != MAGICPLAN_PINS_FILE_HEADER || pgver != PG_VERSION_NUM / 100)
+		goto data_error;
+
+	for (i = 0; i < count; i++)
+	{
+		uint64 fingerprint;
+		uint64 fenced;
+		int mode;
+
+		if (fread(&fingerprint, sizeof(uint64), 1, file) != 1 ||
+			fread(&fenced, sizeof(uint64), 1, file) != 1 ||
+			fread(&mode, sizeof(int), 1, file) != 1)
+			goto read_error;
+		if (fingerprint == 0 || mode <= MAGICPLAN_PIN_NONE || mode > MAGICPLAN_PIN_SEARCH)
+			goto data_error;
+		if (!magicplan_pin_store(fingerprint, fenced, mode))
+		{
+			ereport(LOG,
+					(errmsg("magicplan.max_pins is too low to load all the pins")));
+			break;
+		}
+	}
+
+	FreeFile(file);
+	return;
+
+read_error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not read file \"%s\": %m",
+					MAGICPLAN_PINS_FILE)));
+	goto fail;
+data_error:
+	ereport(LOG,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("ignoring invalid data in file \"%s\"",
+					MAGICPLAN_PINS_FILE)));
+fail:
+	if (file)
+		FreeFile(file);
+}
+
+/*
+ * Pick the sublinks to fence for a cached query.
+ * Without execution feedback, this is the cost based decision. With it, both
+ * variants are first run until they have been timed feedback_min_samples
+ * times, starting with the cost based one, and then the fastest variant on
+ * average is used.
+ */
+static uint64
+magicplan_feedback_choice(magicplanCacheEntry *entry)
+{
+	uint64 other;
+	int64 chosen_runs,
+		  other_runs;
+	double pristine_mean,
+		   fenced_mean;
+
+	if (!magicplan_feedback || entry->fence_candidate == 0)
+		return entry->fenced;
+
+	if (entry->fenced != 0)
+	{
+		other = 0;
+		chosen_runs = entry->fenced_runs;
+		other_runs = entry->pristine_runs;
+	}
+	else
+	{
+		other = entry->fence_candidate;
+		chosen_runs = entry->pristine_runs;
+		other_runs = entry->fenced_runs;
+	}
+	if (chosen_runs < magicplan_feedback_min_samples)
+		return entry->fenced;
+	if (other_runs < magicplan_feedback_min_samples)
+		return other;
+
+	pristine_mean = entry->pristine_time / entry->pristine_runs;
+	fenced_mean = entry->fenced_time / entry->fenced_runs;
+	return (fenced_mean < pristine_mean) ? entry->fence_candidate : 0;
+}
+
+/*
+ * Remember which sublinks are fenced in the plan made for a query, for the
+ * executor hooks.
+ */
+static void
+magicplan_feedback_remember(uint64 queryid, uint64 fingerprint, uint64 fenced)
+{
+	magicplanFeedbackEntry *entry;
+	bool found;
+
+	if (!magicplan_feedback || !MAGICPLAN_CACHE_AVAILABLE() || queryid == 0)
+		return;
+
+	/* This is only a hint, start again from scratch when it gets too big */
+	if (magicplan_feedback_hash &&
+		hash_get_num_entries(magicplan_feedback_hash) >= MAGICPLAN_FEEDBACK_MAX_ENTRIES)
+	{
+		hash_destroy(magicplan_feedback_hash);
+		magicplan_feedback_hash = NULL;
+	}
+	if (!magicplan_feedback_hash)
+	{
+		HASHCTL info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(uint64);
+		info.entrysize = sizeof(magicplanFeedbackEntry);
+		magicplan_feedback_hash = hash_create("magicplan feedback", 256, &info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	entry = (magicplanFeedbackEntry *) hash_search(magicplan_feedback_hash, &queryid, HASH_ENTER, &found);
+	entry->fingerprint = fingerprint;
+	entry->fenced = fenced;
+}
+
+/*
+ * Add an execution time to the feedback of a cached query.
+ */
+static void
+magicplan_feedback_record(uint64 fingerprint, uint64 fenced, double time)
+{
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+	magicplanCacheEntry *entry;
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_SHARED);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_FIND, NULL);
+	if (entry)
+	{
+		MAGICPLAN_ENTRY_BEGIN_WRITE(entry);
+		if (fenced == 0)
+		{
+			entry->pristine_runs++;
+			entry->pristine_time += time;
+		}
+		else if (fenced == entry->fence_candidate)
+		{
+			entry->fenced_runs++;
+			entry->fenced_time += time;
+		}
+		MAGICPLAN_ENTRY_END_WRITE(entry);
+	}
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+}
+
+/*
+ * ExecutorStart hook: make sure the execution of queries planned by magicplan
+ * is timed when the feedback is enabled.
+ */
+static void
+magicplan_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	uint64 queryid;
+
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
+
+	queryid = queryDesc->plannedstmt->queryId;
+	if (magicplan_feedback && magicplan_feedback_hash && queryid != 0 &&
+		!(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+		hash_search(magicplan_feedback_hash, &queryid, HASH_FIND, NULL) != NULL &&
+		queryDesc->totaltime == NULL)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(queryDesc->estate->es_query_cxt);
+
+#if PG_VERSION_NUM >= 140000
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_TIMER, false);
+#else
+		queryDesc->totaltime = InstrAlloc(1, INSTRUMENT_TIMER);
+#endif
+		MemoryContextSwitchTo(oldcontext);
+	}
+}
+
+/*
+ * ExecutorRun and ExecutorFinish hooks: the queries planned meanwhile are
+ * run by functions or triggers, one level deeper.
+ */
+static void
+magicplan_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+					  uint64 count, bool execute_once)
+{
+	magicplan_nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+	}
+	PG_CATCH();
+	{
+		magicplan_nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	magicplan_nesting_level--;
+}
+
+static void
+magicplan_ExecutorFinish(QueryDesc *queryDesc)
+{
+	magicplan_nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+	}
+	PG_CATCH();
+	{
+		magicplan_nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	magicplan_nesting_level--;
+}
+
+/*
+ * ProcessUtility hook: statements run by a utility command (DO, CALL...) are
+ * nested too. The commands planning their own query, like EXPLAIN or
+ * EXECUTE, leave it at the level of the command.
+ */
+static void
+magicplan_ProcessUtility(PROCESS_UTILITY_ARGS)
+{
+	Node *parsetree = pstmt->utilityStmt;
+	bool nested = !(IsA(parsetree, ExplainStmt) ||
+					IsA(parsetree, ExecuteStmt) ||
+					IsA(parsetree, DeclareCursorStmt) ||
+					IsA(parsetree, CreateTableAsStmt));
+
+	if (nested)
+		magicplan_nesting_level++;
+	PG_TRY();
+	{
+		if (prev_ProcessUtility)
+			prev_ProcessUtility(PROCESS_UTILITY_PARAMS);
+		else
+			standard_ProcessUtility(PROCESS_UTILITY_PARAMS);
+	}
+	PG_CATCH();
+	{
+		if (nested)
+			magicplan_nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	if (nested)
+		magicplan_nesting_level--;
+}
+
+/*
+ * ExecutorEnd hook: store the execution time of queries planned by magicplan
+ * in the decision cache, and flush the pending statistics when they are due.
+ */
+static void
+magicplan_ExecutorEnd(QueryDesc *queryDesc)
+{
+	uint64 queryid = queryDesc->plannedstmt->queryId;
+	magicplanFeedbackEntry *entry;
+
+	if (magicplan_feedback && magicplan_feedback_hash && queryid != 0 && queryDesc->totaltime)
+	{
+		entry = (magicplanFeedbackEntry *) hash_search(magicplan_feedback_hash, &queryid, HASH_FIND, NULL);
+		if (entry)
+		{
+			Cost cost = queryDesc->plannedstmt->planTree->total_cost;
+
+			/* Make sure stats accumulation is done, this can be called twice */
+			InstrEndLoop(queryDesc->totaltime);
+			magicplan_feedback_record(entry->fingerprint, entry->fenced,
+									  queryDesc->totaltime->total * 1000.0);
+			if (cost > 0)
+				magicplan_ms_per_cost = 0.9 * magicplan_ms_per_cost +
+					0.1 * queryDesc->totaltime->total * 1000.0 / cost;
+		}
+	}
+
+	if (prev_ExecutorEnd)
+		prev_ExecutorEnd(queryDesc);
+	else
+		standard_ExecutorEnd(queryDesc);
+
+	/* The calls planned by the last statements of a backend going idle would
+	 * wait for its next planner call otherwise */
+	if (magicplan_pending_stats && hash_get_num_entries(magicplan_pending_stats) > 0 &&
+		TimestampDifferenceExceeds(magicplan_stats_last_flush, GetCurrentTimestamp(), MAGICPLAN_STATS_FLUSH_MS))
+		magicplan_stats_flush();
+}
+
+/*
+ * Add the counters of a backend to the shared statistics of a query
+ * fingerprint, creating the entry if needed.
+ */
+static void
+magicplan_stats_add(const magicplanPendingStats *pending)
+{
+	int partition = MAGICPLAN_PARTITION(pending->fingerprint);
+	HTAB *hash = magicplan_stats_hash[partition];
+	LWLock *lock = magicplan_state->stats_locks[partition];
+	magicplanStatsEntry *entry;
+	bool found;
+
+	/* Only take the exclusive lock if the entry has to be created */
+	LWLockAcquire(lock, LW_SHARED);
+	entry = (magicplanStatsEntry *) hash_search(hash, &pending->fingerprint, HASH_FIND, NULL);
+	if (!entry)
+	{
+		LWLockRelease(lock);
+		LWLockAcquire(lock, LW_EXCLUSIVE);
+		entry = (magicplanStatsEntry *) hash_search(hash, &pending->fingerprint, HASH_FIND, NULL);
+		if (!entry)
+		{
+			if (hash_get_num_entries(hash) >= MAGICPLAN_PARTITION_SIZE(magicplan_stats_max))
+			{
+				HASH_SEQ_STATUS status;
+				magicplanStatsEntry *victim = NULL;
+
+				hash_seq_init(&status, hash);
+				while ((entry = (magicplanStatsEntry *) hash_seq_search(&status)) != NULL)
+				{
+					if (victim == NULL || entry->last_used < victim->last_used)
+						victim = entry;
+				}
+				if (victim)
+					hash_search(hash, &victim->fingerprint, HASH_REMOVE, NULL);
+			}
+			entry = (magicplanStatsEntry *) hash_search(hash, &pending->fingerprint, HASH_ENTER, &found);
+			SpinLockInit(&entry->mutex);
+			memset(&entry->counters, 0, sizeof(magicplanCounters));
+			entry->last_used = 0;
+		}
+	}
+
+	SpinLockAcquire(&entry->mutex);
+	entry->last_used = Max(entry->last_used, pending->last_used);
+	entry->counters.calls += pending->counters.calls;
+	entry->counters.searches += pending->counters.searches;
+	entry->counters.cache_hits += pending->counters.cache_hits;
+	entry->counters.candidates += pending->counters.candidates;
+	entry->counters.wins += pending->counters.wins;
+	entry->counters.total_extra_time += pending->counters.total_extra_time;
+	entry->counters.max_extra_time = Max(entry->counters.max_extra_time,
+										 pending->counters.max_extra_time);
+	entry->counters.sum_base_cost += pending->counters.sum_base_cost;
+	entry->counters.sum_chosen_cost += pending->counters.sum_chosen_cost;
+	SpinLockRelease(&entry->mutex);
+
+	LWLockRelease(lock);
+}
+
+/*
+ * Add the pending counters of this backend to the shared statistics.
+ */
+static void
+magicplan_stats_flush(void)
+{
+	HASH_SEQ_STATUS status;
+	magicplanPendingStats *pending;
+
+	if (!magicplan_pending_stats || !MAGICPLAN_STATS_AVAILABLE())
+		return;
+
+	hash_seq_init(&status, magicplan_pending_stats);
+	while ((pending = (magicplanPendingStats *) hash_seq_search(&status)) != NULL)
+	{
+		magicplan_stats_add(pending);
+		hash_search(magicplan_pending_stats, &pending->fingerprint, HASH_REMOVE, NULL);
+	}
+	magicplan_stats_last_flush = GetCurrentStatementStartTimestamp();
+}
+
+/*
+ * before_shmem_exit callback, so that the last calls of a backend are not
+ * lost.
+ */
+static void
+magicplan_stats_exit(int code, Datum arg)
+{
+	magicplan_stats_flush();
+}
+
+/*
+ * Account for one planner call in the statistics of a query fingerprint.
+ * The call is counted in the backend, and flushed to the shared statistics
+ * later on.
+ */
+static void
+magicplan_stats_record(uint64 fingerprint, bool cache_hit, bool searched,
+					   int candidates, bool won, double extra_time,
+					   Cost base_cost, Cost chosen_cost)
+{
+	TimestampTz now = GetCurrentStatementStartTimestamp();
+	magicplanPendingStats *pending;
+	bool found;
+
+	if (!MAGICPLAN_STATS_AVAILABLE() || fingerprint == 0)
+		return;
+
+	if (!magicplan_pending_stats)
+	{
+		static bool exit_registered = false;
+		HASHCTL info;
+
+		memset(&info, 0, sizeof(info));
+		info.keysize = sizeof(uint64);
+		info.entrysize = sizeof(magicplanPendingStats);
+		magicplan_pending_stats = hash_create("magicplan pending statistics",
+											  MAGICPLAN_STATS_MAX_PENDING,
+											  &info, HASH_ELEM | HASH_BLOBS);
+		if (!exit_registered)
+		{
+			before_shmem_exit(magicplan_stats_exit, (Datum) 0);
+			exit_registered = true;
+		}
+	}
+
+	pending = (magicplanPendingStats *) hash_search(magicplan_pending_stats, &fingerprint, HASH_ENTER, &found);
+	if (!found)
+		memset(&pending->counters, 0, sizeof(magicplanCounters));
+	pending->last_used = now;
+	pending->counters.calls++;
+	if (cache_hit)
+		pending->counters.cache_hits++;
+	if (searched)
+	{
+		pending->counters.searches++;
+		pending->counters.candidates += candidates;
+		if (won)
+			pending->counters.wins++;
+		pending->counters.total_extra_time += extra_time;
+		pending->counters.max_extra_time = Max(pending->counters.max_extra_time, extra_time);
+		pending->counters.sum_base_cost += base_cost;
+		pending->counters.sum_chosen_cost += chosen_cost;
+	}
+
+	if (hash_get_num_entries(magicplan_pending_stats) >= MAGICPLAN_STATS_MAX_PENDING ||
+		TimestampDifferenceExceeds(magicplan_stats_last_flush, now, MAGICPLAN_STATS_FLUSH_MS))
+		magicplan_stats_flush();
+}
+
+/*
+ * Get the statistics of a query fingerprint, the calls this backend did not
+ * flush yet included. Returns false if the query is not tracked.
+ */
+static bool
+magicplan_stats_lookup(uint64 fingerprint, magicplanCounters *result)
+{
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+	magicplanStatsEntry *entry;
+	magicplanPendingStats *pending = NULL;
+	bool found = false;
+
+	if (!MAGICPLAN_STATS_AVAILABLE() || fingerprint == 0)
+		return false;
+
+	memset(result, 0, sizeof(magicplanCounters));
+	LWLockAcquire(magicplan_state->stats_locks[partition], LW_SHARED);
+	entry = (magicplanStatsEntry *) hash_search(magicplan_stats_hash[partition], &fingerprint, HASH_FIND, NULL);
+	if (entry)
+	{
+		SpinLockAcquire(&entry->mutex);
+		*result = entry->counters;
+		SpinLockRelease(&entry->mutex);
+		found = true;
+	}
+	LWLockRelease(magicplan_state->stats_locks[partition]);
+
+	if (magicplan_pending_stats)
+		pending = (magicplanPendingStats *) hash_search(magicplan_pending_stats, &fingerprint, HASH_FIND, NULL);
+	if (pending)
+	{
+		result->calls += pending->counters.calls;
+		result->searches += pending->counters.searches;
+		result->cache_hits += pending->counters.cache_hits;
+		result->candidates += pending->counters.candidates;
+		result->wins += pending->counters.wins;
+		result->total_extra_time += pending->counters.total_extra_time;
+		result->max_extra_time = Max(result->max_extra_time, pending->counters.max_extra_time);
+		result->sum_base_cost += pending->counters.sum_base_cost;
+		result->sum_chosen_cost += pending->counters.sum_chosen_cost;
+		found = true;
+	}
+	return found;
+}
+
+/*
+ * SQL function returning the statistics of every tracked query fingerprint,
+ * used by the pg_stat_magicplan view.
+ */
+#define MAGICPLAN_STATS_COLS 10
+
+Datum
+magicplan_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS status;
+	magicplanStatsEntry *entry;
+	int partition;
+
+	if (!MAGICPLAN_STATS_AVAILABLE())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan statistics are not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.stats_max above 0.")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/* The counters of the other backends show up at their next flush */
+	magicplan_stats_flush();
+
+	for (partition = 0; partition < MAGICPLAN_NUM_PARTITIONS; partition++)
+	{
+		LWLockAcquire(magicplan_state->stats_locks[partition], LW_SHARED);
+		hash_seq_init(&status, magicplan_stats_hash[partition]);
+		while ((entry = (magicplanStatsEntry *) hash_seq_search(&status)) != NULL)
+		{
+			Datum values[MAGICPLAN_STATS_COLS];
+			bool nulls[MAGICPLAN_STATS_COLS];
+			magicplanCounters tmp;
+			int i = 0;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			SpinLockAcquire(&entry->mutex);
+			tmp = entry->counters;
+			SpinLockRelease(&entry->mutex);
+
+			values[i++] = Int64GetDatum((int64) entry->fingerprint);
+			values[i++] = Int64GetDatum(tmp.calls);
+			values[i++] = Int64GetDatum(tmp.searches);
+			values[i++] = Int64GetDatum(tmp.cache_hits);
+			values[i++] = Int64GetDatum(tmp.candidates);
+			values[i++] = Int64GetDatum(tmp.wins);
+			values[i++] = Float8GetDatum(tmp.total_extra_time);
+			values[i++] = Float8GetDatum(tmp.max_extra_time);
+			if (tmp.searches > 0)
+			{
+				values[i++] = Float8GetDatum(tmp.sum_base_cost / tmp.searches);
+				values[i++] = Float8GetDatum(tmp.sum_chosen_cost / tmp.searches);
+			}
+			else
+			{
+				nulls[i++] = true;
+				nulls[i++] = true;
+			}
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+		LWLockRelease(magicplan_state->stats_locks[partition]);
+	}
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL function forgetting all the statistics.
+ */
+Datum
+magicplan_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	magicplanStatsEntry *entry;
+	int partition;
+
+	if (!MAGICPLAN_STATS_AVAILABLE())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan statistics are not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.stats_max above 0.")));
+
+	/* The pending counters of this backend go too */
+	if (magicplan_pending_stats)
+	{
+		hash_destroy(magicplan_pending_stats);
+		magicplan_pending_stats = NULL;
+	}
+
+	for (partition = 0; partition < MAGICPLAN_NUM_PARTITIONS; partition++)
+	{
+		LWLockAcquire(magicplan_state->stats_locks[partition], LW_EXCLUSIVE);
+		hash_seq_init(&status, magicplan_stats_hash[partition]);
+		while ((entry = (magicplanStatsEntry *) hash_seq_search(&status)) != NULL)
+			hash_search(magicplan_stats_hash[partition], &entry->fingerprint, HASH_REMOVE, NULL);
+		LWLockRelease(magicplan_state->stats_locks[partition]);
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL function overriding magicplan.sample_rate for a cached query, until it
+ * leaves the decision cache. A negative rate removes the override.
+ * Returns false if the query is not in the cache.
+ */
+Datum
+magicplan_set_sample_rate(PG_FUNCTION_ARGS)
+{
+	uint64 fingerprint = (uint64) PG_GETARG_INT64(0);
+	int32 sample_rate = PG_GETARG_INT32(1);
+	int partition = MAGICPLAN_PARTITION(fingerprint);
+	magicplanCacheEntry *entry;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan decision cache is not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.cache_size above 0.")));
+
+	LWLockAcquire(magicplan_state->cache_locks[partition], LW_SHARED);
+	entry = (magicplanCacheEntry *) hash_search(magicplan_cache[partition], &fingerprint, HASH_FIND, NULL);
+	if (entry)
+	{
+		MAGICPLAN_ENTRY_BEGIN_WRITE(entry);
+		entry->sample_rate = Max(sample_rate, -1);
+		MAGICPLAN_ENTRY_END_WRITE(entry);
+	}
+	LWLockRelease(magicplan_state->cache_locks[partition]);
+
+	PG_RETURN_BOOL(entry != NULL);
+}
+
+#define MAGICPLAN_DECISIONS_COLS 5
+
+/*
+ * SQL function exporting the decision cache, to be imported elsewhere with
+ * magicplan_import_decision. relids is NULL for decisions depending on too
+ * many relations to be listed. Stale decisions are left out.
+ */
+Datum
+magicplan_decisions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS status;
+	magicplanCacheEntry *entry;
+	int partition;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan decision cache is not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.cache_size above 0.")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	for (partition = 0; partition < MAGICPLAN_NUM_PARTITIONS; partition++)
+	{
+		LWLockAcquire(magicplan_state->cache_locks[partition], LW_SHARED);
+		hash_seq_init(&status, magicplan_cache[partition]);
+		while ((entry = (magicplanCacheEntry *) hash_seq_search(&status)) != NULL)
+		{
+			Datum values[MAGICPLAN_DECISIONS_COLS];
+			bool nulls[MAGICPLAN_DECISIONS_COLS];
+			Datum relids[MAGICPLAN_MAX_RELIDS];
+			int i = 0;
+			int j;
+
+			/* Outdated, the importer would use it as is */
+			if (entry->stale)
+				continue;
+
+			memset(nulls, 0, sizeof(nulls));
+
+			values[i++] = Int64GetDatum((int64) entry->fingerprint);
+			values[i++] = Int32GetDatum(entry->nsublinks);
+			values[i++] = Int64GetDatum((int64) entry->fenced);
+			values[i++] = Int64GetDatum((int64) entry->fence_candidate);
+			if (entry->nrelids >= 0)
+			{
+				for (j = 0; j < entry->nrelids; j++)
+					relids[j] = ObjectIdGetDatum(entry->relids[j]);
+				values[i++] = PointerGetDatum(construct_array(relids, entry->nrelids, OIDOID,
+															  sizeof(Oid), true, 'i'));
+			}
+			else
+				nulls[i++] = true;
+
+			tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		}
+		LWLockRelease(magicplan_state->cache_locks[partition]);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * SQL function storing a decision in the cache, for example one exported
+ * from the primary with magicplan_decisions, to pre-warm a standby.
+ * The decision is searched again once the listed relations change. A NULL
+ * relids means that they are unknown, the first planning searches again.
+ */
+Datum
+magicplan_import_decision(PG_FUNCTION_ARGS)
+{
+	magicplanCacheEntry decision;
+
+	if (!MAGICPLAN_CACHE_AVAILABLE())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan decision cache is not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.cache_size above 0.")));
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("only relids can be NULL")));
+
+	memset(&decision, 0, sizeof(decision));
+	decision.fingerprint = (uint64) PG_GETARG_INT64(0);
+	decision.nsublinks = PG_GETARG_INT32(1);
+	decision.fenced = (uint64) PG_GETARG_INT64(2);
+	decision.fence_candidate = (uint64) PG_GETARG_INT64(3);
+	decision.last_used = GetCurrentStatementStartTimestamp();
+	decision.sample_rate = -1;
+	if (decision.nsublinks < 0 || decision.nsublinks > MAGICPLAN_MAX_SUBLINKS)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("nsublinks must be between 0 and %d", MAGICPLAN_MAX_SUBLINKS)));
+
+	if (PG_ARGISNULL(4))
+		decision.nrelids = -1;
+	else
+	{
+		ArrayType *array = PG_GETARG_ARRAYTYPE_P(4);
+		Datum *relids;
+		bool *relnulls;
+		int nrelids;
+		int i;
+
+		deconstruct_array(array, OIDOID, sizeof(Oid), true, 'i',
+						  &relids, &relnulls, &nrelids);
+		if (nrelids > MAGICPLAN_MAX_RELIDS)
+			decision.nrelids = -1;
+		for (i = 0; i < nrelids && decision.nrelids >= 0; i++)
+		{
+			if (relnulls[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("relids cannot contain NULL values")));
+			decision.relids[decision.nrelids++] = DatumGetObjectId(relids[i]);
+		}
+		for (i = 0; i < decision.nrelids; i++)
+			decision.signature += magicplan_relation_signature(decision.relids[i]);
+	}
+
+	magicplan_cache_insert(&decision);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL function pinning a query fingerprint to a mode: "pristine" to always
+ * plan it as it is, "fence" to always fence the given sublinks, or "search"
+ * to always search it, ignoring the decision and negative caches.
+ */
+Datum
+magicplan_pin(PG_FUNCTION_ARGS)
+{
+	uint64 fingerprint;
+	char *mode_name;
+	uint64 fenced = 0;
+	int mode = MAGICPLAN_PIN_NONE;
+	bool stored;
+	int i;
+
+	if (!magicplan_pins)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan pins are not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.max_pins above 0.")));
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("fingerprint and mode cannot be NULL")));
+	fingerprint = (uint64) PG_GETARG_INT64(0);
+	mode_name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	if (!PG_ARGISNULL(2))
+		fenced = (uint64) PG_GETARG_INT64(2);
+
+	for (i = MAGICPLAN_PIN_PRISTINE; i <= MAGICPLAN_PIN_SEARCH; i++)
+	{
+		if (pg_strcasecmp(mode_name, magicplan_pin_modes[i]) == 0)
+			mode = i;
+	}
+	if (mode == MAGICPLAN_PIN_NONE)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unrecognized pin mode: \"%s\"", mode_name),
+				 errhint("Valid modes are \"pristine\", \"fence\" and \"search\".")));
+	if (fingerprint == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fingerprint cannot be 0")));
+	if (mode != MAGICPLAN_PIN_FENCE)
+		fenced = 0;
+
+	LWLockAcquire(magicplan_state->pins_lock, LW_EXCLUSIVE);
+	stored = magicplan_pin_store(fingerprint, fenced, mode);
+	if (stored)
+		magicplan_pins_save();
+	LWLockRelease(magicplan_state->pins_lock);
+
+	if (!stored)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many magicplan pins"),
+				 errhint("Unpin other queries, or increase magicplan.max_pins.")));
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * SQL function removing the pin of a query fingerprint. Returns false if it
+ * was not pinned.
+ */
+Datum
+magicplan_unpin(PG_FUNCTION_ARGS)
+{
+	uint64 fingerprint = (uint64) PG_GETARG_INT64(0);
+	bool removed;
+
+	if (!magicplan_pins)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan pins are not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.max_pins above 0.")));
+
+	LWLockAcquire(magicplan_state->pins_lock, LW_EXCLUSIVE);
+	removed = magicplan_pin_store(fingerprint, 0, MAGICPLAN_PIN_NONE);
+	if (removed)
+		magicplan_pins_save();
+	LWLockRelease(magicplan_state->pins_lock);
+
+	PG_RETURN_BOOL(removed);
+}
+
+#define MAGICPLAN_PINS_COLS 3
+
+/*
+ * SQL function listing the pins
+ */
+Datum
+magicplan_list_pins(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext per_query_ctx;
+	MemoryContext oldcontext;
+	int i;
+
+	if (!magicplan_pins)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("magicplan pins are not available"),
+				 errhint("magicplan must be loaded via shared_preload_libraries, with magicplan.max_pins above 0.")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	/* Writers hold the lock exclusively, the slots can be read as they are */
+	LWLockAcquire(magicplan_state->pins_lock, LW_SHARED);
+	for (i = 0; i < MAGICPLAN_PIN_SLOTS(); i++)
+	{
+		magicplanPinSlot *slot = &magicplan_pins[i];
+		Datum values[MAGICPLAN_PINS_COLS];
+		bool nulls[MAGICPLAN_PINS_COLS];
+		int j = 0;
+
+		if (slot->fingerprint == 0 || slot->mode == MAGICPLAN_PIN_NONE)
+			continue;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[j++] = Int64GetDatum((int64) slot->fingerprint);
+		values[j++] = CStringGetTextDatum(magicplan_pin_modes[slot->mode]);
+		values[j++] = Int64GetDatum((int64) slot->fenced);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(magicplan_state->pins_lock);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Remember what was done for the query being planned, for EXPLAIN.
+ */
+static void
+magicplan_report_decision(magicplanDecision decision, magicplan_search_context *context,
+						  uint64 fenced, Cost base_cost, Cost chosen_cost, double extra_time)
+{
+	magicplan_last_decision.decision = decision;
+	magicplan_last_decision.fingerprint = context->fingerprint;
+	magicplan_last_decision.nsublinks = context->scan.nsublinks;
+	magicplan_last_decision.fenced = fenced;
+	magicplan_last_decision.candidates = context->candidates;
+	magicplan_last_decision.base_cost = base_cost;
+	magicplan_last_decision.chosen_cost = chosen_cost;
+	magicplan_last_decision.extra_time = extra_time;
+}
+
+/*
+ * Unit arguments have been added to ExplainPropertyInteger and
+ * ExplainPropertyFloat in PG11.
+ */
+#if PG_VERSION_NUM >= 110000
+#define EXPLAIN_PROPERTY_INTEGER(label, value, es) ExplainPropertyInteger(label, NULL, value, es)
+#define EXPLAIN_PROPERTY_FLOAT(label, unit, value, ndigits, es) ExplainPropertyFloat(label, unit, value, ndigits, es)
+#else
+#define EXPLAIN_PROPERTY_INTEGER(label, value, es) ExplainPropertyLong(label, value, es)
+#define EXPLAIN_PROPERTY_FLOAT(label, unit, value, ndigits, es) ExplainPropertyFloat(label, value, ndigits, es)
+#endif
+
+/*
+ * Print the "Magicplan" section of EXPLAIN. Nothing is printed for queries
+ * magicplan had nothing to do with, and the costs and timings follow the
+ * COSTS and SUMMARY options like the rest of the output.
+ */
+static void
+magicplan_explain_decision(magicplanDecisionReport *report, ExplainState *es)
+{
+	StringInfoData fenced;
+	const char *decision;
+	int i;
+
+	switch (report->decision)
+	{
+		case MAGICPLAN_DECISION_CACHED:
+			decision = "cached";
+			break;
+		case MAGICPLAN_DECISION_CHEAP:
+			decision = "skipped, cost below magicplan.ignore_cost_below";
+			break;
+		case MAGICPLAN_DECISION_ADAPTIVE:
+			decision = "skipped, expected savings below the search overhead";
+			break;
+		case MAGICPLAN_DECISION_NEGATIVE:
+			decision = "skipped, never benefited";
+			break;
+		case MAGICPLAN_DECISION_NESTED:
+			decision = "skipped, nested deeper than magicplan.max_nesting_level";
+			break;
+		case MAGICPLAN_DECISION_PREPARED:
+			decision = "skipped, plan kind excluded by magicplan.prepared_plans";
+			break;
+		case MAGICPLAN_DECISION_PINNED:
+			decision = "pinned";
+			break;
+		case MAGICPLAN_DECISION_QUEUED:
+			decision = "queued for a background search";
+			break;
+		case MAGICPLAN_DECISION_CONCURRENT:
+			decision = "skipped, searched by another backend";
+			break;
+		case MAGICPLAN_DECISION_SEARCHED:
+			decision = "searched";
+			break;
+		default:
+			return;
+	}
+
+	/* Sublinks are numbered from 1, in the order they were scanned */
+	initStringInfo(&fenced);
+	for (i = 0; i < report->nsublinks; i++)
+	{
+		if (report->fenced & (UINT64CONST(1) << i))
+			appendStringInfo(&fenced, "%s%d", fenced.len > 0 ? ", " : "", i + 1);
+	}
+	if (fenced.len == 0)
+		appendStringInfoString(&fenced, "none");
+
+	ExplainOpenGroup("Magicplan", NULL, true, es);
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfoString(es->str, "Magicplan:\n");
+		es->indent++;
+	}
+	ExplainPropertyText("Decision", decision, es);
+	if (es->verbose && report->fingerprint != 0)
+		EXPLAIN_PROPERTY_INTEGER("Fingerprint", (int64) report->fingerprint, es);
+	EXPLAIN_PROPERTY_INTEGER("Candidate Sublinks", report->nsublinks, es);
+	ExplainPropertyText("Fenced Sublinks", fenced.data, es);
+	if (report->decision == MAGICPLAN_DECISION_SEARCHED)
+		EXPLAIN_PROPERTY_INTEGER("Candidates Planned", report->candidates, es);
+	/* Only the decisions that planned the pristine query know its cost */
+	if (es->costs && (report->decision == MAGICPLAN_DECISION_CHEAP ||
+					  report->decision == MAGICPLAN_DECISION_ADAPTIVE ||
+					  report->decision == MAGICPLAN_DECISION_QUEUED ||
+					  report->decision == MAGICPLAN_DECISION_CONCURRENT ||
+					  report->decision == MAGICPLAN_DECISION_SEARCHED))
+		EXPLAIN_PROPERTY_FLOAT("Pristine Cost", NULL, report->base_cost, 2, es);
+	if (es->costs && report->decision == MAGICPLAN_DECISION_SEARCHED)
+		EXPLAIN_PROPERTY_FLOAT("Chosen Cost", NULL, report->chosen_cost, 2, es);
+	if (es->summary && report->decision == MAGICPLAN_DECISION_SEARCHED)
+		EXPLAIN_PROPERTY_FLOAT("Extra Planning Time", "ms", report->extra_time, 3, es);
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+		es->indent--;
+	ExplainCloseGroup("Magicplan", NULL, true, es);
+	pfree(fenced.data);
+}
+
+/*
+ * ExplainOnePlan closes the "Query" group of the plan, while the Magicplan
+ * section of the structured formats belongs inside it, next to the plan.
+ * Reopen the group by taking back its closing text, as ExplainCloseGroup
+ * printed it. Returns false if the output does not end with it, when another
+ * EXPLAIN hook printed something else, the section then follows the query.
+ */
+static bool
+magicplan_explain_reopen_query(ExplainState *es)
+{
+	StringInfoData closing;
+	bool reopened;
+
+	initStringInfo(&closing);
+	switch (es->format)
+	{
+		case EXPLAIN_FORMAT_JSON:
+			appendStringInfoChar(&closing, '\n');
+			appendStringInfoSpaces(&closing, 2 * es->indent);
+			appendStringInfoChar(&closing, '}');
+			break;
+		case EXPLAIN_FORMAT_XML:
+			appendStringInfoSpaces(&closing, 2 * es->indent);
+			appendStringInfoString(&closing, "</Query>\n");
+			break;
+		default:
+			/* Nothing is printed at the end of a YAML group */
+			break;
+	}
+	reopened = es->str->len >= closing.len &&
+		memcmp(es->str->data + es->str->len - closing.len, closing.data, closing.len) == 0;
+	if (reopened)
+	{
+		es->str->len -= closing.len;
+		es->str->data[es->str->len] = '\0';
+		es->indent++;
+		/* The group already has properties, the plan */
+		if (es->format != EXPLAIN_FORMAT_XML)
+			es->grouping_stack = lcons_int(1, es->grouping_stack);
+	}
+	pfree(closing.data);
+	return reopened;
+}
+
+/*
+ * EXPLAIN hook. This does what ExplainOneQuery does, keeping aside the
+ * decision made by the planner before the plan is printed and possibly
+ * executed, since the execution can plan other queries.
+ */
+static void
+magicplan_ExplainOneQuery(Query *query, int cursorOptions, IntoClause *into,
+						  ExplainState *es, const char *queryString,
+						  ParamListInfo params, QueryEnvironment *queryEnv)
+{
+	magicplanDecisionReport report;
+
+	magicplan_last_decision.decision = MAGICPLAN_DECISION_NONE;
+	if (prev_ExplainOneQuery)
+	{
+		/* The decision can only be read once the plan is printed */
+		prev_ExplainOneQuery(query, cursorOptions, into, es, queryString,
+							 params, queryEnv);
+		report = magicplan_last_decision;
+	}
+	else
+	{
+		PlannedStmt *plan;
+		instr_time planstart,
+				   planduration;
+#if PG_VERSION_NUM >= 130000
+		BufferUsage bufusage_start,
+					bufusage;
+
+		if (es->buffers)
+			bufusage_start = pgBufferUsage;
+#endif
+		INSTR_TIME_SET_CURRENT(planstart);
+#if PG_VERSION_NUM >= 130000
+		plan = pg_plan_query(query, queryString, cursorOptions, params);
+#else
+		plan = pg_plan_query(query, cursorOptions, params);
+#endif
+		INSTR_TIME_SET_CURRENT(planduration);
+		INSTR_TIME_SUBTRACT(planduration, planstart);
+		report = magicplan_last_decision;
+
+#if PG_VERSION_NUM >= 130000
+		if (es->buffers)
+		{
+			memset(&bufusage, 0, sizeof(BufferUsage));
+			BufferUsageAccumDiff(&bufusage, &pgBufferUsage, &bufusage_start);
+		}
+		ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+					   &planduration, (es->buffers ? &bufusage : NULL));
+#else
+		ExplainOnePlan(plan, into, es, queryString, params, queryEnv,
+					   &planduration);
+#endif
+	}
+
+	if (report.decision != MAGICPLAN_DECISION_NONE && es->format != EXPLAIN_FORMAT_TEXT &&
+		magicplan_explain_reopen_query(es))
+	{
+		magicplan_explain_decision(&report, es);
+		ExplainCloseGroup("Query", NULL, true, es);
+	}
+	else
+		magicplan_explain_decision(&report, es);
+}
+
+#if PG_VERSION_NUM >= 130000
+/*
+ * Whether a statement text is a single SELECT, which the worker can explain
+ * without running anything else.
+ */
+static bool
+magicplan_async_single_select(const char *query)
+{
+	List *parsetree;
+
+#if PG_VERSION_NUM >= 140000
+	parsetree = raw_parser(query, RAW_PARSE_DEFAULT);
+#else
+	parsetree = raw_parser(query);
+#endif
+	return list_length(parsetree) == 1 &&
+		IsA(((RawStmt *) linitial(parsetree))->stmt, SelectStmt);
+}
+#endif
+
+/*
+ * Queue the search of the query being planned for a background worker.
+ * Returns false if that cannot be done, the search must then be done inline.
+ * The worker replays the query text, so queries with parameters, queries
+ * run under another role than the session one, and queries whose text is
+ * not known or too long for a slot are not queued. So are the queries that
+ * are not a statement of their own, like the ones of EXPLAIN, DECLARE or
+ * CREATE TABLE AS: their text is the whole command. The query text is only
+ * given to the planner since PG13.
+ */
+static bool
+magicplan_async_enqueue(magicplan_search_context * context, uint64 fingerprint)
+{
+#if PG_VERSION_NUM >= 130000
+	Query *parse = context->base_query;
+	const char *query = context->queryString;
+	int location = parse->stmt_location;
+	int len = parse->stmt_len;
+	char *statement;
+	TimestampTz now = GetCurrentTimestamp();
+	magicplanAsyncSlot *slot = NULL;
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	uint32 generation = 0;
+	int slotno = -1;
+	int i;
+
+	if (!magicplan_async_queue || !MAGICPLAN_CACHE_AVAILABLE() || fingerprint == 0 ||
+		query == NULL || context->boundParams != NULL || context->scan.has_params ||
+		GetUserId() != GetSessionUserId() ||
+		strlen(namespace_search_path) >= MAGICPLAN_ASYNC_SEARCH_PATH_LEN)
+		return false;
+
+	/* Only keep the text of this statement. Without a length, it runs to
+	 * the end of the string, and the queries of utility commands like
+	 * CREATE TABLE AS get the whole string: the text must hold this SELECT
+	 * alone, or other statements would be run again by the worker */
+	if (location < 0)
+		return false;
+	if (len <= 0)
+		len = strlen(query + location);
+	if (len >= pgstat_track_activity_query_size)
+		return false;
+	statement = pnstrdup(query + location, len);
+	if (!magicplan_async_single_select(statement))
+	{
+		pfree(statement);
+		return false;
+	}
+
+	for (i = 0; i < magicplan_async_queue_size; i++)
+	{
+		magicplanAsyncSlot *candidate = ASYNC_SLOT(i);
+		bool queued;
+
+		SpinLockAcquire(&candidate->mutex);
+		queued = candidate->state != MAGICPLAN_ASYNC_FREE &&
+			candidate->fingerprint == fingerprint;
+		if (slot == NULL && !queued &&
+			(candidate->state == MAGICPLAN_ASYNC_FREE ||
+			 (candidate->state == MAGICPLAN_ASYNC_QUEUED &&
+			  TimestampDifferenceExceeds(candidate->queued_at, now, MAGICPLAN_ASYNC_STALE_MS))))
+		{
+			candidate->state = MAGICPLAN_ASYNC_FILLING;
+			candidate->fingerprint = fingerprint;
+			generation = ++candidate->generation;
+			slot = candidate;
+			slotno = i;
+		}
+		SpinLockRelease(&candidate->mutex);
+
+		/* Already waiting for a worker, nothing to do */
+		if (queued)
+		{
+			if (slot != NULL)
+			{
+				SpinLockAcquire(&slot->mutex);
+				slot->state = MAGICPLAN_ASYNC_FREE;
+				SpinLockRelease(&slot->mutex);
+			}
+			return true;
+		}
+	}
+	if (slot == NULL)
+		return false;
+
+	slot->queued_at = now;
+	slot->dboid = MyDatabaseId;
+	slot->roleid = GetUserId();
+	strlcpy(slot->search_path, namespace_search_path, MAGICPLAN_ASYNC_SEARCH_PATH_LEN);
+	memcpy(slot->query, statement, len + 1);
+	pfree(statement);
+
+	SpinLockAcquire(&slot->mutex);
+	slot->state = MAGICPLAN_ASYNC_QUEUED;
+	SpinLockRelease(&slot->mutex);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "magicplan");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "magicplan_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "magicplan search");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "magicplan search");
+	worker.bgw_main_arg = Int32GetDatum(slotno);
+	memcpy(worker.bgw_extra, &generation, sizeof(uint32));
+	worker.bgw_notify_pid = 0;
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+	{
+		elog(DEBUG1, "magicplan - no background worker available, searching inline");
+		SpinLockAcquire(&slot->mutex);
+		slot->state = MAGICPLAN_ASYNC_FREE;
+		SpinLockRelease(&slot->mutex);
+		return false;
+	}
+	elog(DEBUG1, "magicplan - queued query " UINT64_FORMAT " for a background search", fingerprint);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Free the slot of a background worker when it exits, whatever the reason.
+ */
+static void
+magicplan_worker_release(int code, Datum arg)
+{
+	magicplanAsyncSlot *slot = ASYNC_SLOT(DatumGetInt32(arg));
+
+	SpinLockAcquire(&slot->mutex);
+	slot->state = MAGICPLAN_ASYNC_FREE;
+	SpinLockRelease(&slot->mutex);
+}
+
+/*
+ * Background worker searching a queued query. The query is explained, so
+ * that the planner hook does the search and stores the decision. If that
+ * fails, nothing is stored, as the failure may not happen again, but it
+ * counts as a search keeping the pristine plan for the negative cache, so
+ * that a query failing each time is not queued again and again.
+ */
+void
+magicplan_worker_main(Datum main_arg)
+{
+	int slotno = DatumGetInt32(main_arg);
+	magicplanAsyncSlot *slot;
+	uint32 generation;
+	uint64 fingerprint;
+	Oid dboid,
+		roleid;
+	char *search_path;
+	StringInfoData explain;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	if (!magicplan_async_queue || slotno < 0 || slotno >= magicplan_async_queue_size)
+		proc_exit(0);
+
+	/* The slot may have been given to another query meanwhile */
+	memcpy(&generation, MyBgworkerEntry->bgw_extra, sizeof(uint32));
+	slot = ASYNC_SLOT(slotno);
+	SpinLockAcquire(&slot->mutex);
+	if (slot->state != MAGICPLAN_ASYNC_QUEUED || slot->generation != generation)
+	{
+		SpinLockRelease(&slot->mutex);
+		proc_exit(0);
+	}
+	slot->state = MAGICPLAN_ASYNC_RUNNING;
+	SpinLockRelease(&slot->mutex);
+	before_shmem_exit(magicplan_worker_release, main_arg);
+
+	fingerprint = slot->fingerprint;
+	dboid = slot->dboid;
+	roleid = slot->roleid;
+	search_path = pstrdup(slot->search_path);
+	initStringInfo(&explain);
+	appendStringInfo(&explain, "EXPLAIN %s", slot->query);
+
+#if PG_VERSION_NUM >= 110000
+	BackgroundWorkerInitializeConnectionByOid(dboid, roleid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(dboid, roleid);
+#endif
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PG_TRY();
+	{
+		SetConfigOption("search_path", search_path, PGC_USERSET, PGC_S_SESSION);
+		SPI_connect();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, explain.data);
+		magicplan_async_target = fingerprint;
+		magicplan_async_done = false;
+		SPI_execute(explain.data, false, 0);
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		EmitErrorReport();
+		FlushErrorState();
+		AbortCurrentTransaction();
+	}
+	PG_END_TRY();
+	magicplan_async_target = 0;
+
+	if (!magicplan_async_done)
+	{
+		elog(LOG, "magicplan - background search of query " UINT64_FORMAT " failed", fingerprint);
+		magicplan_negative_record(fingerprint, false);
+	}
+	pgstat_report_activity(STATE_IDLE, NULL);
+	proc_exit(0);
+}
+
+static PlannedStmt *
+real_plan(magicplan_search_context *context)
+{
+	if (prev_planner)
+		return prev_planner(HOOK_PARAMS(context));
+	else
+		return standard_planner(HOOK_PARAMS(context));
+}
+
+/*
+ * pg_attribute_noinline appeared in PG11.
+ */
+#ifndef pg_attribute_noinline
+#if defined(__GNUC__)
+#define pg_attribute_noinline __attribute__((noinline))
+#else
+#define pg_attribute_noinline
+#endif
+#endif
+
+/*
+ * Probe points, to trace the searches with perf or bpftrace uprobes on
+ * magicplan.so. They do nothing, the compiler barrier keeps their calls from
+ * being optimized away.
+ */
+pg_attribute_noinline void
+magicplan_probe_search_start(uint64 fingerprint, int nranked)
+{
+	pg_compiler_barrier();
+}
+
+pg_attribute_noinline void
+magicplan_probe_candidate(uint64 fingerprint, uint64 fences, double planning_time)
+{
+	pg_compiler_barrier();
+}
+
+pg_attribute_noinline void
+magicplan_probe_search_done(uint64 fingerprint, int candidates, uint64 fenced, double search_time)
+{
+	pg_compiler_barrier();
+}
+
+/*
+ * Share of the work of a parallel plan done by each process, as the planner
+ * computes it in get_parallel_divisor
+ */
+static double
+parallel_divisor(double workers)
+{
+	double divisor = workers;
+
+#if PG_VERSION_NUM >= 110000
+	if (parallel_leader_participation)
+#endif
+	{
+		double leader_contribution = 1.0 - 0.3 * workers;
+
+		if (leader_contribution > 0)
+			divisor += leader_contribution;
+	}
+	return Max(divisor, 1.0);
+}
+
+/*
+ * Extra cost of the Gather and Gather Merge nodes of a plan tree when only
+ * magicplan.parallel_availability of their workers are launched. The cost
+ * of their partial subplan is the cost of one process, it grows as the work
+ * gets divided between fewer processes.
+ */
+static Cost
+parallel_penalty(Plan *plan)
+{
+	Cost penalty = 0;
+	List *children = NIL;
+	ListCell *lc;
+
+	if (plan == NULL)
+		return 0;
+
+	if ((IsA(plan, Gather) || IsA(plan, GatherMerge)) && plan->lefttree != NULL)
+	{
+		int workers = IsA(plan, Gather) ? ((Gather *) plan)->num_workers
+										: ((GatherMerge *) plan)->num_workers;
+
+		penalty += plan->lefttree->total_cost *
+			(parallel_divisor(workers) / parallel_divisor(workers * magicplan_parallel_availability) - 1.0);
+	}
+
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			children = ((Append *) plan)->appendplans;
+			break;
+		case T_MergeAppend:
+			children = ((MergeAppend *) plan)->mergeplans;
+			break;
+		case T_SubqueryScan:
+			penalty += parallel_penalty(((SubqueryScan *) plan)->subplan);
+			break;
+		case T_CustomScan:
+			children = ((CustomScan *) plan)->custom_plans;
+			break;
+		default:
+			break;
+	}
+	foreach(lc, children)
+		penalty += parallel_penalty((Plan *) lfirst(lc));
+
+	return penalty + parallel_penalty(plan->lefttree) + parallel_penalty(plan->righttree);
+}
+
+/*
+ * Cost the executor is expected to pay for a plan, which is what the
+ * candidates are compared on.
+ * A cursor asking for a fast plan is expected to fetch only
+ * cursor_tuple_fraction of the rows, the planner does the same computation.
+ * The top-level LIMIT needs no special care: the total_cost of the Limit node
+ * at the top of the plan already is the fractional cost of its subplan.
+ */
+static Cost
+plan_goal_cost(magicplan_search_context * context, PlannedStmt *plan)
+{
+	Plan *top = plan->planTree;
+	Cost total_cost = top->total_cost;
+
+	/* Workers may be missing at execution time, see parallel_penalty */
+	if (magicplan_parallel_availability < 1.0)
+	{
+		ListCell *lc;
+
+		total_cost += parallel_penalty(top);
+		foreach(lc, plan->subplans)
+			total_cost += parallel_penalty((Plan *) lfirst(lc));
+	}
+
+	if ((context->cursorOptions & CURSOR_OPT_FAST_PLAN) && cursor_tuple_fraction < 1.0)
+	{
+		double fraction = Max(cursor_tuple_fraction, 1e-10);
+
+		return top->startup_cost + fraction * (total_cost - top->startup_cost);
+	}
+	return total_cost;
+}
+
+/*
+ * Keep track of the memory used by the plans alive during the search.
+ * Memory accounting is only available since PG13.
+ */
+static void
+track_search_memory(magicplan_search_context * context, MemoryContext candidate_context)
+{
+#if PG_VERSION_NUM >= 130000
+	Size used = MemoryContextMemAllocated(context->base_context, true);
+
+	if (context->best_context != context->base_context)
+		used += MemoryContextMemAllocated(context->best_context, true);
+	if (candidate_context != NULL)
+		used += MemoryContextMemAllocated(candidate_context, true);
+	context->peak_memory = Max(context->peak_memory, used);
+#endif
+}
+
+/*
+ * Check whether another candidate can be planned within the search budget.
+ * The next candidate is expected to take as long as the previous ones did on
+ * average, or as long as the pristine plan for the first one, so that the
+ * budget is not overshot by a whole planning.
+ */
+static bool
+search_budget_exhausted(magicplan_search_context * context)
+{
+	if (context->budget_exhausted)
+		return true;
+
+	if (magicplan_max_candidates > 0 && context->candidates >= magicplan_max_candidates)
+		context->budget_exhausted = true;
+	else if (magicplan_planning_budget > 0 || magicplan_planning_budget_ratio > 0)
+	{
+		instr_time now;
+		double elapsed,
+			   expected;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, context->search_start);
+		elapsed = INSTR_TIME_GET_MILLISEC(now);
+		if (context->candidates > 0)
+			expected = elapsed + elapsed / context->candidates;
+		else
+			expected = context->base_planning_time;
+
+		if ((magicplan_planning_budget > 0 && expected > magicplan_planning_budget) ||
+			(magicplan_planning_budget_ratio > 0 &&
+			 expected > magicplan_planning_budget_ratio * context->base_planning_time))
+			context->budget_exhausted = true;
+	}
+
+	if (context->budget_exhausted)
+		elog(DEBUG1, "magicplan - search budget exhausted after %d candidates", context->candidates);
+	return context->budget_exhausted;
+}
+
+/*
+ * Set an OFFSET 0 in the candidate sublinks listed in fences, and remove it
+ * from the other ones. CTEs are materialized instead. This is done in place,
+ * in the subqueries found by the scan, so base_query must only be planned
+ * through a copy while searching.
+ */
+static void
+apply_fences(magicplan_search_context * context, uint64 fences)
+{
+	int i;
+
+	for (i = 0; i < context->scan.nsublinks; i++)
+	{
+		bool fenced = (fences & (UINT64CONST(1) << i)) != 0;
+
+		if (context->scan.ctes[i] != NULL)
+		{
+#if PG_VERSION_NUM >= 120000
+			context->scan.ctes[i]->ctematerialized = fenced ? CTEMaterializeAlways : CTEMaterializeDefault;
+#endif
+		}
+		else if (fenced)
+			context->scan.subqueries[i]->limitOffset = context->offset_zero;
+		else
+			context->scan.subqueries[i]->limitOffset = NULL;
+	}
+}
+
+/*
+ * Plan base_query with the given sublinks fenced, compare the plan with the
+ * current best_plan, and keep the cheapest one in the search context.
+ * The cost of the candidate is returned in *cost.
+ */
+static bool
+find_best_query(magicplan_search_context * context, uint64 fences, Cost *cost)
+{
+	PlannedStmt *candidate_plan;
+	MemoryContext candidate_context;
+	MemoryContext oldcontext;
+	instr_time start_time,
+			   planning_time;
+	/* Everything the planner allocates for this candidate goes in a dedicated
+	 * context, so that it can be thrown away at once if it's not the best.
+	 */
+	candidate_context = AllocSetContextCreate(CurrentMemoryContext,
+											  "magicplan candidate",
+											  ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(candidate_context);
+	/* We need to copy the query before planning it, because the planner
+	 * will change the query (replacing sublinks by subplans, among other
+	 * things), even for the last candidate: if it loses, the caller's query
+	 * would be left planned, and pointing into memory that can't be freed.
+	 * Sharing the untouched parts between candidates is not possible for
+	 * the same reason, a single copy of the whole tree is the least the
+	 * planner needs.
+	 */
+	INSTR_TIME_SET_CURRENT(start_time);
+	if (magicplan_wait_event)
+		pgstat_report_wait_start(PG_WAIT_EXTENSION);
+	apply_fences(context, fences);
+	context->current_query = copyObject(context->base_query);
+	candidate_plan = real_plan(context);
+	if (magicplan_wait_event)
+		pgstat_report_wait_end();
+	INSTR_TIME_SET_CURRENT(planning_time);
+	INSTR_TIME_SUBTRACT(planning_time, start_time);
+	MemoryContextSwitchTo(oldcontext);
+	context->candidates++;
+	magicplan_probe_candidate(context->fingerprint, fences, INSTR_TIME_GET_MILLISEC(planning_time));
+	if (context->candidate_times)
+		appendStringInfo(context->candidate_times, ", " UINT64_FORMAT ": %.3f ms",
+						 fences, INSTR_TIME_GET_MILLISEC(planning_time));
+	track_search_memory(context, candidate_context);
+	*cost = plan_goal_cost(context, candidate_plan);
+	/* Only keep the candidate if it's worthwile. On a tie, the first one
+	 * planned is kept, which is the one with the fewest fences. */
+	if (*cost < plan_goal_cost(context, context->best_plan))
+	{
+		if (context->best_context != context->base_context)
+			MemoryContextDelete(context->best_context);
+		context->best_context = candidate_context;
+		context->best_plan = candidate_plan;
+		context->fenced = fences;
+		return true;
+	}
+	MemoryContextDelete(candidate_context);
+	return false;
+}
+
+/*
+ * Greedy search: try to fence each ranked sublink in turn, on top of the fences
+ * that lowered the cost so far. This plans one candidate per sublink, but
+ * misses the fences that only pay off together.
+ * Until a fence is kept, the candidates are singletons and the ones leaving
+ * the cost unchanged are recorded, as in search_singletons.
+ */
+static void
+search_greedy(magicplan_search_context * context)
+{
+	Cost base_cost = plan_goal_cost(context, context->base_plan);
+	Cost cost;
+	int i;
+
+	for (i = 0; i < context->nranked; i++)
+	{
+		uint64 fence = UINT64CONST(1) << context->ranked[i];
+		bool singleton = context->fenced == 0;
+
+		if (search_budget_exhausted(context))
+			break;
+		find_best_query(context, context->fenced | fence, &cost);
+		if (singleton && cost == base_cost)
+			context->same_cost |= fence;
+	}
+}
+
+/*
+ * Insert a state in a beam sorted by increasing cost, dropping the most
+ * expensive one once the beam holds width states.
+ */
+static void
+beam_insert(magicplan_beam_state *beam, int *nbeam, int width, uint64 fences, Cost cost)
+{
+	int i = *nbeam;
+
+	if (i == width)
+	{
+		if (cost >= beam[width - 1].cost)
+			return;
+		i--;
+	}
+	else
+		(*nbeam)++;
+
+	while (i > 0 && beam[i - 1].cost > cost)
+	{
+		beam[i] = beam[i - 1];
+		i--;
+	}
+	beam[i].fences = fences;
+	beam[i].cost = cost;
+}
+
+/*
+ * Plan each sublink fenced on its own, and fill the beam with the cheapest
+ * ones. A fence that leaves the cost unchanged does not change the plan
+ * either (the planner would not have pulled that sublink up anyway), so it
+ * is left out of the returned mask: combinations are only made of the
+ * fences that matter.
+ */
+static uint64
+search_singletons(magicplan_search_context * context, magicplan_beam_state *beam, int *nbeam)
+{
+	Cost base_cost = plan_goal_cost(context, context->base_plan);
+	uint64 useful = 0;
+	int i;
+
+	*nbeam = 0;
+	for (i = 0; i < context->nranked; i++)
+	{
+		uint64 fence = UINT64CONST(1) << context->ranked[i];
+		Cost cost;
+
+		if (search_budget_exhausted(context))
+			break;
+		find_best_query(context, fence, &cost);
+		if (cost != base_cost)
+		{
+			useful |= fence;
+			beam_insert(beam, nbeam, magicplan_beam_width, fence, cost);
+		}
+		else
+			context->same_cost |= fence;
+	}
+	return useful;
+}
+
+/*
+ * Starting from the given beam, add one more useful fence to each state at
+ * every level, keeping the cheapest combinations for the next level.
+ * This stops once a level does not improve on the best plan.
+ */
+static void
+expand_beam(magicplan_search_context * context, magicplan_beam_state *beam, int nbeam, uint64 useful)
+{
+	magicplan_beam_state next[MAGICPLAN_MAX_BEAM_WIDTH];
+	uint64 *seen;
+
+	/* Combinations already planned at the current level */
+	seen = palloc(sizeof(uint64) * magicplan_beam_width * context->scan.nsublinks);
+	while (nbeam > 0 && !context->budget_exhausted)
+	{
+		Cost best_cost = plan_goal_cost(context, context->best_plan);
+		int nnext = 0,
+			nseen = 0,
+			s,
+			i,
+			j;
+
+		for (s = 0; s < nbeam && !context->budget_exhausted; s++)
+		{
+			for (i = 0; i < context->scan.nsublinks; i++)
+			{
+				uint64 fence = UINT64CONST(1) << i;
+				uint64 fences = beam[s].fences | fence;
+				Cost cost;
+
+				if (!(useful & fence) || (beam[s].fences & fence))
+					continue;
+				for (j = 0; j < nseen && seen[j] != fences; j++)
+					;
+				if (j < nseen)
+					continue;
+				if (search_budget_exhausted(context))
+					break;
+				seen[nseen++] = fences;
+				find_best_query(context, fences, &cost);
+				beam_insert(next, &nnext, magicplan_beam_width, fences, cost);
+			}
+		}
+
+		if (plan_goal_cost(context, context->best_plan) >= best_cost)
+			break;
+		memcpy(beam, next, sizeof(magicplan_beam_state) * nnext);
+		nbeam = nnext;
+	}
+	pfree(seen);
+}
+
+/*
+ * Beam search: keep the magicplan.beam_width cheapest combinations of
+ * fences, and grow them one fence at a time.
+ */
+static void
+search_beam(magicplan_search_context * context)
+{
+	magicplan_beam_state beam[MAGICPLAN_MAX_BEAM_WIDTH];
+	int nbeam;
+	uint64 useful;
+
+	useful = search_singletons(context, beam, &nbeam);
+	expand_beam(context, beam, nbeam, useful);
+}
+
+/*
+ * Exhaustive search: plan every combination of the useful fences, by
+ * increasing number of fences so that the smallest change wins a tie.
+ * With more than magicplan.exhaustive_limit useful fences, this falls back
+ * to a beam search.
+ */
+static void
+search_exhaustive(magicplan_search_context * context)
+{
+	magicplan_beam_state beam[MAGICPLAN_MAX_BEAM_WIDTH];
+	int positions[MAGICPLAN_MAX_SUBLINKS];
+	int nbeam,
+		npositions = 0,
+		size,
+		i;
+	uint64 useful,
+		   subset;
+
+	useful = search_singletons(context, beam, &nbeam);
+	for (i = 0; i < context->scan.nsublinks; i++)
+	{
+		if (useful & (UINT64CONST(1) << i))
+			positions[npositions++] = i;
+	}
+	if (npositions > magicplan_exhaustive_limit)
+	{
+		elog(DEBUG1, "magicplan - %d useful sublinks, falling back to a beam search", npositions);
+		expand_beam(context, beam, nbeam, useful);
+		return;
+	}
+
+	for (size = 2; size <= npositions; size++)
+	{
+		for (subset = 1; subset < (UINT64CONST(1) << npositions); subset++)
+		{
+			uint64 fences = 0;
+			int nfences = 0;
+			Cost cost;
+
+			for (i = 0; i < npositions; i++)
+			{
+				if (subset & (UINT64CONST(1) << i))
+				{
+					fences |= UINT64CONST(1) << positions[i];
+					nfences++;
+				}
+			}
+			if (nfences != size)
+				continue;
+			if (search_budget_exhausted(context))
+				return;
+			find_best_query(context, fences, &cost);
+		}
+	}
+}
+
+/*
+ * Return the kind of a sublink (MAGICPLAN_SUBLINK_*) if an OFFSET 0 can be
+ * injected in its subquery, or 0 if it is not a candidate.
+ * Whether the kind is enabled in magicplan.sublink_types is not checked here,
+ * so that the positions of the sublinks do not depend on that setting.
+ */
+static int
+sublink_fence_kind(SubLink *sublink, bool negated)
+{
+	Query *subquery = (Query*) sublink->subselect;
+
+	/* If the query already has an offset, there is nothing to inject */
+	if (subquery->limitOffset != NULL)
+		return 0;
+
+	switch (sublink->subLinkType)
+	{
+		case EXISTS_SUBLINK:
+			return negated ? MAGICPLAN_SUBLINK_NOT_EXISTS : MAGICPLAN_SUBLINK_EXISTS;
+		case ANY_SUBLINK:
+			/* Only uncorrelated IN (SELECT ...) are pulled up as a join,
+			 * never NOT IN */
+			if (negated || contain_vars_of_level((Node *) subquery, 1))
+				return 0;
+			return MAGICPLAN_SUBLINK_ANY;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Return MAGICPLAN_SUBLINK_CTE if a CTE would be inlined by the planner, so
+ * that materializing it is a choice (see SS_process_ctes), or 0. CTEs are
+ * always materialized before PG12.
+ */
+static int
+cte_fence_kind(CommonTableExpr *cte)
+{
+#if PG_VERSION_NUM >= 120000
+	Query *ctequery = (Query *) cte->ctequery;
+
+	if (cte->ctematerialized != CTEMaterializeDefault || cte->cterefcount != 1 ||
+		cte->cterecursive || ctequery->commandType != CMD_SELECT ||
+		ctequery->hasModifyingCTE || contain_volatile_functions((Node *) ctequery))
+		return 0;
+	return MAGICPLAN_SUBLINK_CTE;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Record a candidate found by the scan, at the next position
+ */
+static void
+scan_record(magicplan_scan_context *context, int kind, Query *subquery, CommonTableExpr *cte)
+{
+	if (kind == 0 || context->nsublinks >= MAGICPLAN_MAX_SUBLINKS)
+		return;
+	if (kind & magicplan_sublink_types)
+	{
+		context->enabled |= UINT64CONST(1) << context->nsublinks;
+		context->nenabled++;
+	}
+	context->kinds[context->nsublinks] = kind;
+	context->ctes[context->nsublinks] = cte;
+	context->parents[context->nsublinks] = context->current;
+	context->subqueries[context->nsublinks++] = subquery;
+}
+
+/*
+ * Callback for the expression_tree_walker, query_tree_walker functions.
+ * We don't care about most nodes except for queries, which we recurse into,
+ * sublinks the planner could pull up as a join: EXISTS(SELECT ..),
+ * NOT EXISTS(SELECT ...) and IN (SELECT ...), CTEs it could inline and
+ * subqueries in FROM. Their subqueries are recorded in the context, in
+ * traversal order, nested sublinks first, without modifying or copying
+ * anything.
+ */
+bool
+magicplan_scan_walker (Node *node, magicplan_scan_context *context)
+{
+	if (node == NULL)
+		return false;
+
+	if (IsA(node, Query))
+	{
+		Query *parent = context->current;
+		bool result;
+
+		context->current = (Query *) node;
+		result = query_tree_walker((Query*) node, magicplan_scan_walker, context, MAGICPLAN_SCAN_FLAGS);
+		context->current = parent;
+		return result;
+	}
+	if (IsA(node, CommonTableExpr))
+	{
+		CommonTableExpr *cte = (CommonTableExpr *) node;
+
+		magicplan_scan_walker(cte->ctequery, context);
+		scan_record(context, cte_fence_kind(cte), (Query *) cte->ctequery, cte);
+		return false;
+	}
+	if (IsA(node, RangeTblEntry))
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) node;
+
+		/* The subquery itself is walked next by range_table_walker */
+		if (rte->rtekind == RTE_SUBQUERY && rte->subquery->limitOffset == NULL)
+			scan_record(context, MAGICPLAN_SUBLINK_SUBQUERY, rte->subquery, NULL);
+		return false;
+	}
+	if (IsA(node, BoolExpr) && ((BoolExpr*) node)->boolop == NOT_EXPR &&
+		IsA(linitial(((BoolExpr*) node)->args), SubLink))
+	{
+		context->negated = true;
+		return expression_tree_walker(node, magicplan_scan_walker, context);
+	}
+	if (IsA(node, Param) && ((Param *) node)->paramkind == PARAM_EXTERN)
+		context->has_params = true;
+	if (IsA(node, SubLink))
+	{
+		SubLink * sublink = (SubLink*) node;
+		bool negated = context->negated;
+
+		context->negated = false;
+		if (sublink->subselect->type == T_Query)
+		{
+			Query *parent = context->current;
+
+			magicplan_scan_walker(sublink->testexpr, context);
+			context->current = (Query *) sublink->subselect;
+			query_tree_walker((Query*) sublink->subselect, magicplan_scan_walker, context, MAGICPLAN_SCAN_FLAGS);
+			context->current = parent;
+			scan_record(context, sublink_fence_kind(sublink, negated),
+						(Query *) sublink->subselect, NULL);
+		}
+		return false;
+	}
+	return expression_tree_walker(node, magicplan_scan_walker, context);
+}
+
+/*
+ * Structural fingerprint of a query: a hash of its nodes, of the relations,
+ * functions and operators they refer to, and of the shape of the join tree,
+ * that ignores the values of the constants. Mixed a 64-bit word at a time
+ * with FNV-1a, the hash functions of the server taking 64-bit seeds are not
+ * available in every supported version.
+ */
+typedef struct
+{
+	uint64 hash;
+} magicplan_fingerprint_context;
+
+static void
+fingerprint_add(magicplan_fingerprint_context *context, uint64 value)
+{
+	context->hash = (context->hash ^ value) * UINT64CONST(0x100000001b3);
+}
+
+static void
+fingerprint_add_string(magicplan_fingerprint_context *context, const char *str)
+{
+	if (str == NULL)
+	{
+		fingerprint_add(context, 0);
+		return;
+	}
+	for (; *str; str++)
+		fingerprint_add(context, (unsigned char) *str);
+	fingerprint_add(context, 0);
+}
+
+static void
+fingerprint_add_sortgroup(magicplan_fingerprint_context *context, List *clauses)
+{
+	ListCell *lc;
+
+	fingerprint_add(context, list_length(clauses));
+	foreach(lc, clauses)
+	{
+		SortGroupClause *clause = (SortGroupClause *) lfirst(lc);
+
+		fingerprint_add(context, clause->tleSortGroupRef);
+		fingerprint_add(context, clause->sortop);
+		fingerprint_add(context, clause->nulls_first);
+	}
+}
+
+/*
+ * Callback for the expression_tree_walker, query_tree_walker functions,
+ * adding each node to the fingerprint. Two queries with the same fingerprint
+ * have the same structure, so magicplan_scan_walker gives their candidate
+ * sublinks the same positions, and a cached placement of fences applies to
+ * both.
+ */
+static bool
+magicplan_fingerprint_walker(Node *node, magicplan_fingerprint_context *context)
+{
+	if (node == NULL)
+	{
+		fingerprint_add(context, 0);
+		return false;
+	}
+
+	fingerprint_add(context, nodeTag(node));
+	switch (nodeTag(node))
+	{
+		case T_Query:
+			{
+				Query *query = (Query *) node;
+
+				fingerprint_add(context, query->commandType);
+				fingerprint_add(context, list_length(query->rtable));
+				fingerprint_add(context, query->hasAggs | query->hasWindowFuncs << 1 |
+								query->hasDistinctOn << 2 | query->hasForUpdate << 3 |
+								(query->groupingSets != NIL) << 4);
+				fingerprint_add_sortgroup(context, query->sortClause);
+				fingerprint_add_sortgroup(context, query->groupClause);
+				fingerprint_add_sortgroup(context, query->distinctClause);
+				return query_tree_walker(query, magicplan_fingerprint_walker, context,
+										 MAGICPLAN_SCAN_FLAGS);
+			}
+		case T_RangeTblEntry:
+			{
+				RangeTblEntry *rte = (RangeTblEntry *) node;
+
+				/* The contents of the entry are walked next by range_table_walker */
+				fingerprint_add(context, rte->rtekind);
+				fingerprint_add(context, rte->relid);
+				fingerprint_add(context, rte->jointype);
+				fingerprint_add(context, rte->inh);
+				fingerprint_add(context, rte->ctelevelsup);
+				fingerprint_add_string(context, rte->ctename);
+				return false;
+			}
+		case T_CommonTableExpr:
+			{
+				CommonTableExpr *cte = (CommonTableExpr *) node;
+
+				fingerprint_add_string(context, cte->ctename);
+				fingerprint_add(context, cte->cterecursive);
+#if PG_VERSION_NUM >= 120000
+				fingerprint_add(context, cte->ctematerialized);
+#endif
+				break;
+			}
+		case T_Const:
+			/* Only the type, so that literal variants share a fingerprint */
+			fingerprint_add(context, ((Const *) node)->consttype);
+			break;
+		case T_Var:
+			{
+				Var *var = (Var *) node;
+
+				fingerprint_add(context, var->varno);
+				fingerprint_add(context, var->varattno);
+				fingerprint_add(context, var->varlevelsup);
+				break;
+			}
+		case T_Param:
+			fingerprint_add(context, ((Param *) node)->paramkind);
+			fingerprint_add(context, ((Param *) node)->paramid);
+			fingerprint_add(context, ((Param *) node)->paramtype);
+			break;
+		case T_Aggref:
+			fingerprint_add(context, ((Aggref *) node)->aggfnoid);
+			break;
+		case T_WindowFunc:
+			fingerprint_add(context, ((WindowFunc *) node)->winfnoid);
+			break;
+		case T_FuncExpr:
+			fingerprint_add(context, ((FuncExpr *) node)->funcid);
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			fingerprint_add(context, ((OpExpr *) node)->opno);
+			break;
+		case T_ScalarArrayOpExpr:
+			fingerprint_add(context, ((ScalarArrayOpExpr *) node)->opno);
+			fingerprint_add(context, ((ScalarArrayOpExpr *) node)->useOr);
+			break;
+		case T_BoolExpr:
+			fingerprint_add(context, ((BoolExpr *) node)->boolop);
+			break;
+		case T_SubLink:
+			fingerprint_add(context, ((SubLink *) node)->subLinkType);
+			break;
+		case T_NullTest:
+			fingerprint_add(context, ((NullTest *) node)->nulltesttype);
+			break;
+		case T_BooleanTest:
+			fingerprint_add(context, ((BooleanTest *) node)->booltesttype);
+			break;
+		case T_RelabelType:
+			fingerprint_add(context, ((RelabelType *) node)->resulttype);
+			break;
+		case T_CoerceViaIO:
+			fingerprint_add(context, ((CoerceViaIO *) node)->resulttype);
+			break;
+		case T_FieldSelect:
+			fingerprint_add(context, ((FieldSelect *) node)->fieldnum);
+			break;
+		case T_TargetEntry:
+			fingerprint_add(context, ((TargetEntry *) node)->resno);
+			fingerprint_add(context, ((TargetEntry *) node)->ressortgroupref);
+			fingerprint_add(context, ((TargetEntry *) node)->resjunk);
+			break;
+		case T_RangeTblRef:
+			fingerprint_add(context, ((RangeTblRef *) node)->rtindex);
+			break;
+		case T_JoinExpr:
+			fingerprint_add(context, ((JoinExpr *) node)->jointype);
+			fingerprint_add(context, ((JoinExpr *) node)->rtindex);
+			break;
+		case T_List:
+			fingerprint_add(context, list_length((List *) node));
+			break;
+		default:
+			break;
+	}
+	return expression_tree_walker(node, magicplan_fingerprint_walker, context);
+}
+
+/*
+ * Key of a query in the decision cache, the negative cache, the pins and the
+ * statistics, according to magicplan.fingerprint. Returns 0 if the query
+ * cannot be identified.
+ */
+static uint64
+magicplan_fingerprint(Query *parse)
+{
+	magicplan_fingerprint_context context;
+	uint64 hash;
+
+	if (magicplan_fingerprint_mode == MAGICPLAN_FINGERPRINT_QUERY_ID ||
+		(magicplan_fingerprint_mode == MAGICPLAN_FINGERPRINT_AUTO && parse->queryId != 0))
+	{
+		/* 0 stands for a query that cannot be identified */
+		if (parse->queryId == 0)
+			return 0;
+		hash = (uint64) parse->queryId;
+	}
+	else
+	{
+		context.hash = UINT64CONST(0xcbf29ce484222325);
+		magicplan_fingerprint_walker((Node *) parse, &context);
+		hash = context.hash;
+	}
+
+	/* The databases of a cluster can have the same schema, down to the
+	 * relation OIDs, and get the same queries: keep their decisions apart */
+	hash ^= (uint64) MyDatabaseId * UINT64CONST(0x9e3779b97f4a7c15);
+
+	/* Spread the bits, the caches use the low ones to find their slots */
+	hash ^= hash >> 33;
+	hash *= UINT64CONST(0xff51afd7ed558ccd);
+	hash ^= hash >> 33;
+
+	return hash != 0 ? hash : 1;
+}
+
+/*
+ * Context for the walker looking for the correlated columns of a subquery
+ */
+typedef struct
+{
+	Query *subquery;
+	double ndistinct;          // Highest ndistinct of the correlated columns
+} magicplan_prefilter_context;
+
+/*
+ * Context for the walker looking for the outer relations a subquery is
+ * correlated with
+ */
+typedef struct
+{
+	Query *parent;             // Query the subquery is in
+	int levelsup;              // varlevelsup of its Vars in the current query
+	double outer_tuples;       // Highest reltuples of the outer relations
+	bool unknown;              // One of them is not a relation, or never analyzed
+} magicplan_outer_context;
+
+/*
+ * Number of tuples of a relation from pg_class, or -1 if it is unknown
+ */
+static double
+magicplan_relation_tuples(Oid relid)
+{
+	HeapTuple tuple;
+	double reltuples = -1;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (HeapTupleIsValid(tuple))
+	{
+		reltuples = ((Form_pg_class) GETSTRUCT(tuple))->reltuples;
+		ReleaseSysCache(tuple);
+	}
+	return reltuples;
+}
+
+/*
+ * Signature of the state of a relation in pg_class. It changes with the
+ * statistics ANALYZE and VACUUM store there, with the relfilenode, and with
+ * every other update of the row, which DDL does. A dropped relation gets 0.
+ */
+static uint64
+magicplan_relation_signature(Oid relid)
+{
+	magicplan_fingerprint_context context;
+	HeapTuple tuple;
+	Form_pg_class form;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return 0;
+	form = (Form_pg_class) GETSTRUCT(tuple);
+	context.hash = UINT64CONST(0xcbf29ce484222325);
+	fingerprint_add(&context, relid);
+	/* The raw xmin, freezing the row does not change it */
+	fingerprint_add(&context, HeapTupleHeaderGetRawXmin(tuple->t_data));
+	fingerprint_add(&context, form->relfilenode);
+	fingerprint_add(&context, form->relpages);
+	fingerprint_add(&context, (uint64) (int64) form->reltuples);
+	fingerprint_add(&context, form->relallvisible);
+	ReleaseSysCache(tuple);
+	return context.hash;
+}
+
+static bool
+magicplan_query_signature_walker(Node *node, uint64 *signature)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, RangeTblEntry))
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) node;
+
+		if (rte->rtekind == RTE_RELATION)
+			*signature += magicplan_relation_signature(rte->relid);
+		return false;
+	}
+	if (IsA(node, Query))
+		return query_tree_walker((Query *) node, magicplan_query_signature_walker, signature,
+								 MAGICPLAN_SCAN_FLAGS);
+	return expression_tree_walker(node, magicplan_query_signature_walker, signature);
+}
+
+/*
+ * Signature of the relations of base_query, sublinks included, computed once
+ * per search.
+ */
+static uint64
+magicplan_query_signature(magicplan_search_context *context)
+{
+	if (context->query_signature == 0)
+		magicplan_query_signature_walker((Node *) context->base_query, &context->query_signature);
+	return context->query_signature;
+}
+
+/*
+ * Signature of the relations a plan depends on, stored with its decision:
+ * the planner compares it with the current one at each lookup, so that a
+ * change on one of them gets the decision searched again once, by the first
+ * backend planning the query. The relations of the query are used when the
+ * plan depends on too many of them to be listed in the cache, partitions
+ * included.
+ */
+static uint64
+magicplan_plan_signature(magicplan_search_context *context, List *relationOids)
+{
+	uint64 signature = 0;
+	ListCell *lc;
+
+	if (list_length(relationOids) > MAGICPLAN_MAX_RELIDS)
+		return magicplan_query_signature(context);
+	foreach(lc, relationOids)
+		signature += magicplan_relation_signature(lfirst_oid(lc));
+	return signature;
+}
+
+/*
+ * Current signature of the relations of a cached decision, to compare with
+ * the one it was stored with.
+ */
+static uint64
+magicplan_entry_signature(magicplan_search_context *context, const magicplanCacheEntry *entry)
+{
+	uint64 signature = 0;
+	int i;
+
+	if (entry->nrelids < 0)
+		return magicplan_query_signature(context);
+	for (i = 0; i < entry->nrelids; i++)
+		signature += magicplan_relation_signature(entry->relids[i]);
+	return signature;
+}
+
+/*
+ * Number of distinct values of a column from pg_statistic, or 0 if it is
+ * unknown
+ */
+static double
+magicplan_column_ndistinct(RangeTblEntry *rte, AttrNumber attnum)
+{
+	HeapTuple tuple;
+	double ndistinct = 0;
+
+	tuple = SearchSysCache3(STATRELATTINH,
+							ObjectIdGetDatum(rte->relid),
+							Int16GetDatum(attnum),
+							BoolGetDatum(rte->inh));
+	if (HeapTupleIsValid(tuple))
+	{
+		ndistinct = ((Form_pg_statistic) GETSTRUCT(tuple))->stadistinct;
+		ReleaseSysCache(tuple);
+		/* Negative values are a fraction of the number of rows */
+		if (ndistinct < 0)
+			ndistinct = -ndistinct * Max(magicplan_relation_tuples(rte->relid), 0.0);
+	}
+	return ndistinct;
+}
+
+/*
+ * Find the columns of the subquery compared to the outer query, and keep
+ * the highest ndistinct among them. Nested subqueries are not looked into.
+ */
+static bool
+magicplan_prefilter_walker(Node *node, magicplan_prefilter_context *context)
+{
+	if (node == NULL || IsA(node, Query))
+		return false;
+	if (IsA(node, OpExpr) && list_length(((OpExpr *) node)->args) == 2)
+	{
+		Node *left = linitial(((OpExpr *) node)->args);
+		Node *right = lsecond(((OpExpr *) node)->args);
+		Var *inner = NULL;
+
+		if (IsA(left, Var) && ((Var *) left)->varlevelsup == 0 && contain_vars_of_level(right, 1))
+			inner = (Var *) left;
+		else if (IsA(right, Var) && ((Var *) right)->varlevelsup == 0 && contain_vars_of_level(left, 1))
+			inner = (Var *) right;
+		if (inner != NULL && inner->varattno > 0)
+		{
+			RangeTblEntry *rte = rt_fetch(inner->varno, context->subquery->rtable);
+
+			if (rte->rtekind == RTE_RELATION)
+				context->ndistinct = Max(context->ndistinct,
+										 magicplan_column_ndistinct(rte, inner->varattno));
+		}
+		return false;
+	}
+	return expression_tree_walker(node, magicplan_prefilter_walker, context);
+}
+
+/*
+ * Find the Vars of the subquery that refer to the query it is in, nested
+ * subqueries included, and keep the highest number of tuples of their
+ * relations.
+ */
+static bool
+magicplan_outer_walker(Node *node, magicplan_outer_context *context)
+{
+	if (node == NULL)
+		return false;
+	if (IsA(node, Query))
+	{
+		bool result;
+
+		context->levelsup++;
+		result = query_tree_walker((Query *) node, magicplan_outer_walker, context, 0);
+		context->levelsup--;
+		return result;
+	}
+	if (IsA(node, Var) && ((Var *) node)->varlevelsup == context->levelsup)
+	{
+		Var *var = (Var *) node;
+		RangeTblEntry *rte = rt_fetch(var->varno, context->parent->rtable);
+		double reltuples = -1;
+
+		if (rte->rtekind == RTE_RELATION)
+			reltuples = magicplan_relation_tuples(rte->relid);
+		if (reltuples <= 0)
+			context->unknown = true;
+		else
+			context->outer_tuples = Max(context->outer_tuples, reltuples);
+		return false;
+	}
+	return expression_tree_walker(node, magicplan_outer_walker, context);
+}
+
+/*
+ * Estimate how much fencing a sublink could gain, from the statistics only.
+ * Fenced, the subquery is run once per outer row and stops at the first
+ * match, which costs at best a lookup among the distinct values of its
+ * correlated columns, for each row of the outer relations it is correlated
+ * with. Unfenced, the relations of the subquery are joined, which reads them
+ * about once. The gain is the ratio of both. The outer relations are counted
+ * whole: the rows of the plan would be those left after an aggregate or a
+ * LIMIT, and the restrictions are not known before planning. It is negative
+ * for sublinks the planner never pulls up, on which the fence changes
+ * nothing, and infinite when the statistics do not tell.
+ */
+static double
+magicplan_estimate_gain(magicplan_search_context *context, int position)
+{
+	Query *subquery = context->scan.subqueries[position];
+	int kind = context->scan.kinds[position];
+	magicplan_prefilter_context prefilter;
+	magicplan_outer_context outer;
+	double inner_tuples = 0;
+	double ndistinct;
+	int nrelations = 0;
+	ListCell *lc;
+
+	/* For CTEs and subqueries in FROM, the fence also keeps the quals from
+	 * being pushed down, the statistics alone do not tell */
+	if (kind == MAGICPLAN_SUBLINK_CTE || kind == MAGICPLAN_SUBLINK_SUBQUERY)
+		return HUGE_VAL;
+	/* Not simple enough to be pulled up, see simplify_EXISTS_query and
+	 * is_simple_subquery */
+	if (subquery->hasAggs || subquery->hasWindowFuncs || subquery->setOperations ||
+		subquery->groupingSets || subquery->havingQual)
+		return -1.0;
+	/* IN (SELECT ...) are never correlated, the estimate does not apply */
+	if (kind == MAGICPLAN_SUBLINK_ANY)
+		return HUGE_VAL;
+	/* An uncorrelated EXISTS is run once as an InitPlan, fenced or not */
+	if (!contain_vars_of_level((Node *) subquery, 1))
+		return -1.0;
+
+	foreach(lc, subquery->rtable)
+	{
+		RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+		double reltuples;
+
+		if (rte->rtekind != RTE_RELATION)
+			continue;
+		reltuples = magicplan_relation_tuples(rte->relid);
+		/* Never analyzed */
+		if (reltuples <= 0)
+			return HUGE_VAL;
+		inner_tuples += reltuples;
+		nrelations++;
+	}
+	if (nrelations == 0)
+		return HUGE_VAL;
+
+	outer.parent = context->scan.parents[position];
+	outer.levelsup = 1;
+	outer.outer_tuples = 0;
+	outer.unknown = false;
+	query_tree_walker(subquery, magicplan_outer_walker, &outer, 0);
+	if (outer.unknown || outer.outer_tuples <= 0)
+		return HUGE_VAL;
+
+	prefilter.subquery = subquery;
+	prefilter.ndistinct = 0;
+	magicplan_prefilter_walker((Node *) subquery->jointree, &prefilter);
+	ndistinct = prefilter.ndistinct > 0 ? prefilter.ndistinct : Min(inner_tuples, DEFAULT_NUM_DISTINCT);
+	return inner_tuples / (outer.outer_tuples * (1.0 + log2(Max(ndistinct, 1.0))));
+}
+
+/*
+ * Fill the ranked sublinks of the search context: all the enabled ones in
+ * order without magicplan.prefilter, else the ones the estimated gain keeps,
+ * by decreasing gain and up to magicplan.prefilter_top of them. On a sampled
+ * search, the sublinks whose OFFSET 0 alone left the cost unchanged at the
+ * last search are left out, planning them again would be wasted.
+ */
+static void
+magicplan_rank_sublinks(magicplan_search_context *context)
+{
+	double gains[MAGICPLAN_MAX_SUBLINKS];
+	int i,
+		j;
+
+	context->nranked = 0;
+	for (i = 0; i < context->scan.nsublinks; i++)
+	{
+		double gain;
+
+		if (!(context->scan.enabled & (UINT64CONST(1) << i)))
+			continue;
+		if (context->same_cost & (UINT64CONST(1) << i))
+		{
+			elog(DEBUG1, "magicplan - skipped sublink %d, its OFFSET 0 did not change the cost before", i + 1);
+			continue;
+		}
+		if (!magicplan_prefilter)
+		{
+			context->ranked[context->nranked++] = i;
+			continue;
+		}
+		gain = magicplan_estimate_gain(context, i);
+		if (gain < 0 || gain < magicplan_prefilter_min_gain)
+		{
+			elog(DEBUG1, "magicplan - prefilter skipped sublink %d, estimated gain %f", i + 1, gain);
+			continue;
+		}
+		/* Insertion sort, sublinks with the same gain keep their order */
+		for (j = context->nranked; j > 0 && gains[j - 1] < gain; j--)
+		{
+			gains[j] = gains[j - 1];
+			context->ranked[j] = context->ranked[j - 1];
+		}
+		gains[j] = gain;
+		context->ranked[j] = i;
+		context->nranked++;
+	}
+	if (magicplan_prefilter && magicplan_prefilter_top > 0)
+		context->nranked = Min(context->nranked, magicplan_prefilter_top);
+}
+
+/*
+ * Number of candidates magicplan.search_strategy is expected to plan for the
+ * ranked sublinks. This is an upper bound for the exhaustive search, which
+ * only combines the fences that change the cost on their own, and assumes a
+ * single level of expansion for the beam search.
+ */
+static double
+magicplan_expected_candidates(magicplan_search_context *context)
+{
+	double n = context->nranked;
+	double candidates;
+
+	switch (magicplan_search_strategy)
+	{
+		case MAGICPLAN_SEARCH_EXHAUSTIVE:
+			if (context->nranked <= magicplan_exhaustive_limit)
+			{
+				candidates = pow(2.0, n) - 1.0;
+				break;
+			}
+			/* Falls back to a beam search */
+			/* FALLTHROUGH */
+		case MAGICPLAN_SEARCH_BEAM:
+			candidates = n + Min(magicplan_beam_width, n) * Max(n - 1.0, 0.0);
+			break;
+		default:
+			candidates = n;
+			break;
+	}
+	if (magicplan_max_candidates > 0)
+		candidates = Min(candidates, magicplan_max_candidates);
+	return candidates;
+}
+
+/*
+ * Estimate, for magicplan.adaptive, the planning time a search of the query
+ * would cost and the execution time it would save, both in milliseconds.
+ * Each candidate is expected to take as long to plan as the pristine query,
+ * within the search budget. The savings are the average relative cost gain of
+ * the past searches of the query, or the measured gain of the fenced variant
+ * if the feedback timed both, applied to the execution time of the pristine
+ * plan and to all the executions that reuse a search.
+ * Returns false for a query never searched, nothing is known about it.
+ */
+static bool
+magicplan_adaptive_estimate(magicplan_search_context *context, uint64 fingerprint,
+							Cost base_cost, const magicplanCacheEntry *history,
+							double *overhead, double *savings)
+{
+	magicplanCounters counters;
+	double gain,
+		   execution_time,
+		   executions;
+
+	if (!magicplan_stats_lookup(fingerprint, &counters) || counters.searches == 0 ||
+		counters.sum_base_cost <= 0)
+		return false;
+
+	*overhead = magicplan_expected_candidates(context) * context->base_planning_time;
+	if (magicplan_planning_budget > 0)
+		*overhead = Min(*overhead, magicplan_planning_budget);
+	if (magicplan_planning_budget_ratio > 0)
+		*overhead = Min(*overhead, magicplan_planning_budget_ratio * context->base_planning_time);
+
+	gain = 1.0 - counters.sum_chosen_cost / counters.sum_base_cost;
+	execution_time = base_cost * magicplan_ms_per_cost;
+	if (history && history->fence_candidate != 0 &&
+		history->pristine_runs >= magicplan_feedback_min_samples &&
+		history->fenced_runs >= magicplan_feedback_min_samples &&
+		history->pristine_time > 0)
+	{
+		execution_time = history->pristine_time / history->pristine_runs;
+		gain = 1.0 - (history->fenced_time / history->fenced_runs) / execution_time;
+	}
+	executions = Max((double) counters.calls / counters.searches, 1.0);
+	*savings = Max(gain, 0.0) * execution_time * executions;
+	return true;
 }
 
+/*
+ * Threshold a search of the query must cross for its fences to be used.
+ * With magicplan.adaptive, once the feedback timed both variants of the
+ * cached decision, the threshold is scaled by how much the costs overstated
+ * (or understated) the measured speedup of the fenced variant.
+ */
+static double
+magicplan_query_threshold(const magicplanCacheEntry *history)
+{
+	double measured;
+
+	if (!magicplan_adaptive || history == NULL || history->candidate_ratio <= 1.0 ||
+		history->pristine_runs < magicplan_feedback_min_samples ||
+		history->fenced_runs < magicplan_feedback_min_samples ||
+		history->pristine_time <= 0 || history->fenced_time <= 0)
+		return magicplan_threshold;
+
+	measured = (history->pristine_time / history->pristine_runs) /
+		(history->fenced_time / history->fenced_runs);
+	return Max(1.0, magicplan_threshold * history->candidate_ratio / measured);
+}
+
+/*
+ * Tell whether the plan being made is a kind of plan magicplan.prepared_plans
+ * does not search. The plan cache makes the generic plans of a prepared
+ * statement without bound parameters, and its custom plans with them.
+ * history is the cached decision of the query, if any.
+ */
+static bool
+magicplan_prepared_plan_excluded(magicplan_search_context *context, const magicplanCacheEntry *history)
+{
+	bool generic = context->boundParams == NULL;
+	bool force_generic = (context->cursorOptions & CURSOR_OPT_GENERIC_PLAN) != 0;
+	bool force_custom = (context->cursorOptions & CURSOR_OPT_CUSTOM_PLAN) != 0;
+
+	/* Without parameters, generic and custom plans are the same */
+	if (magicplan_prepared_plans == MAGICPLAN_PREPARED_ALL || !context->scan.has_params)
+		return false;
+#if PG_VERSION_NUM >= 120000
+	force_generic |= plan_cache_mode == PLAN_CACHE_MODE_FORCE_GENERIC_PLAN;
+	force_custom |= plan_cache_mode == PLAN_CACHE_MODE_FORCE_CUSTOM_PLAN;
+#endif
+
+	/* A statement that never gets the other kind of plan has to be searched
+	 * on the ones it gets. Custom plans are only left to the generic plan
+	 * once it searched the query: one-shot plans, like the EXECUTE ... USING
+	 * of PL/pgSQL, and the unnamed statements of the extended protocol never
+	 * get a generic plan, and a prepared statement gets its first custom
+	 * plans before it. Their decision is then searched again by the generic
+	 * plan, see magicplan_planner_internal. */
+	if (magicplan_prepared_plans == MAGICPLAN_PREPARED_GENERIC)
+		return !generic && !force_custom && history != NULL && !history->custom_plan;
+	return generic && !force_generic;
+}
+
+/*
+ * Planner hook. The queries planned during the planning, for example to
+ * evaluate a function, are one level deeper.
+ */
 static PlannedStmt *
 magicplan_planner(HOOK_ARGS)
 {
-	magicplan_mutator_context mutator_context;
+	PlannedStmt *result;
+
+	magicplan_nesting_level++;
+	PG_TRY();
+	{
+		result = magicplan_planner_internal(HOOK_ARG_NAMES);
+	}
+	PG_CATCH();
+	{
+		magicplan_nesting_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	magicplan_nesting_level--;
+	return result;
+}
+
+static PlannedStmt *
+magicplan_planner_internal(HOOK_ARGS)
+{
+	magicplan_search_context search_context;
 	Cost best_cost,
 		 base_cost;
-	Query * backup = copyObject(parse);
-	/* Initialize the mutator_context */
-	mutator_context.current_query = parse;
-	#if PG_VERSION_NUM >= 130000
-	mutator_context.queryString = queryString;
-	#endif
-	mutator_context.cursorOptions = cursorOptions;
-	mutator_context.boundParams = boundParams;
-	mutator_context.current_query = parse;
-	mutator_context.base_query = backup;
-	mutator_context.best_query = parse;
-	mutator_context.best_plan = NULL;
+	uint64 fingerprint = 0;
+	magicplanCacheEntry cached;
+	magicplanCacheEntry *history = NULL;
+	magicplanPinSlot pin;
+	bool sampled = false;
+	bool async_search = false;
+	bool pinned_search = false;
+	bool adaptive;
+	bool busy = false;
+	bool custom_plan;
+	int flight = -1;
+	double overhead,
+		   savings,
+		   threshold;
+	MemoryContext oldcontext;
+	instr_time start_time,
+			   base_time,
+			   end_time;
+	PlannedStmt *result;
+	/* Initialize the search_context */
+	search_context.base_query = parse;
+	search_context.current_query = parse;
+#if PG_VERSION_NUM >= 130000
+	search_context.queryString = queryString;
+#endif
+	search_context.cursorOptions = cursorOptions;
+	search_context.boundParams = boundParams;
+	search_context.fingerprint = 0;
+	search_context.best_plan = NULL;
+	search_context.fenced = 0;
+	search_context.candidates = 0;
+	search_context.same_cost = 0;
+	search_context.query_signature = 0;
+	search_context.candidate_times = NULL;
+	search_context.scan.nsublinks = 0;
 
-	/* Plan the original query for future reference */
-	mutator_context.current_query = backup;
-	mutator_context.base_plan = real_plan(&mutator_context);
-	base_cost = mutator_context.base_plan->planTree->total_cost;
-	if (!magicplan_enabled || base_cost < magicplan_ignore_cost_below)
-		return mutator_context.base_plan;
-
-	/* Walk the query tree, and replace the EXISTS() with an EXISTS(... OFFSET
-	 * 0) */
-	query_tree_mutator(parse, magicplan_mutator, &mutator_context, QTW_DONT_COPY_QUERY);
-	mutator_context.current_query = backup;
-
-	/* If we found a better plan with OFFSET 0 sprinkled here and there
-	 * use that if the improvement in cost crosses the magicplan_threshold
+	/* In a background worker, this is the query it has to search */
+	if (magicplan_async_target != 0)
+	{
+		fingerprint = magicplan_fingerprint(parse);
+		if (fingerprint == 0 || fingerprint == magicplan_async_target)
+		{
+			fingerprint = magicplan_async_target;
+			async_search = true;
+		}
+		magicplan_async_target = 0;
+	}
+
+	/* Most queries have no EXISTS at all: find that out without copying
+	 * anything, and hand them untouched to the planner.
+	 */
+	if (!magicplan_enabled)
+		return real_plan(&search_context);
+	search_context.scan.nenabled = 0;
+	search_context.scan.enabled = 0;
+	search_context.scan.negated = false;
+	search_context.scan.has_params = false;
+	search_context.scan.current = parse;
+	query_tree_walker(parse, magicplan_scan_walker, &search_context.scan, MAGICPLAN_SCAN_FLAGS);
+	if (search_context.scan.nenabled == 0)
+		return real_plan(&search_context);
+	custom_plan = boundParams != NULL && search_context.scan.has_params;
+	if (!async_search)
+		fingerprint = magicplan_fingerprint(parse);
+	search_context.fingerprint = fingerprint;
+	search_context.offset_zero = (Node *) makeConst(INT8OID,
+													-1,
+													InvalidOid,
+													sizeof(int64),
+													Int64GetDatum(0),
+													false,
+													true);
+
+	/* A pin overrides everything else: plan the query as told, or search it
+	 * whatever the caches say */
+	if (!async_search && magicplan_pin_lookup(fingerprint, &pin))
+	{
+		if (pin.mode == MAGICPLAN_PIN_SEARCH)
+			pinned_search = true;
+		else
+		{
+			search_context.fenced = pin.mode == MAGICPLAN_PIN_FENCE ?
+				pin.fenced & search_context.scan.enabled : 0;
+			elog(DEBUG1, "magicplan - query " UINT64_FORMAT " is pinned, skipped the search", fingerprint);
+			apply_fences(&search_context, search_context.fenced);
+			magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+			result = real_plan(&search_context);
+			magicplan_report_decision(MAGICPLAN_DECISION_PINNED, &search_context,
+									  search_context.fenced, 0.0, 0.0, 0.0);
+			return result;
+		}
+	}
+
+	/* If this query shape has already been searched, apply the stored
+	 * decision and plan it only once, unless it is sampled for a new search.
 	 */
-	if (mutator_context.best_plan == NULL)
+	if (!async_search && !pinned_search && magicplan_cache_lookup(fingerprint, &cached))
+	{
+		int sample_rate = cached.sample_rate >= 0 ? cached.sample_rate : magicplan_sample_rate;
+
+		if (cached.nsublinks != search_context.scan.nsublinks)
+		{
+			/* Not the query shape we stored */
+			magicplan_cache_remove(fingerprint);
+		}
+		else if (cached.stale || magicplan_entry_signature(&search_context, &cached) != cached.signature)
+		{
+			/* A relation changed since, the decision needs a new search */
+			magicplan_cache_mark_stale(fingerprint, cached.signature);
+			cached.stale = true;
+			elog(DEBUG1, "magicplan - cached decision for query " UINT64_FORMAT " is stale, searching again", fingerprint);
+			history = &cached;
+		}
+		else if (magicplan_prepared_plans == MAGICPLAN_PREPARED_GENERIC && cached.custom_plan &&
+				 boundParams == NULL)
+		{
+			/* The custom plans made before the generic plan searched the
+			 * query with their parameters, the generic plan is searched once
+			 * for all the plans of the statement */
+			elog(DEBUG1, "magicplan - generic plan of query " UINT64_FORMAT " searched again over the decision of a custom plan", fingerprint);
+			history = &cached;
+		}
+		else if (sample_rate > 0 && magicplan_sample(sample_rate))
+		{
+			/* Search again from time to time, to follow changes in the data */
+			elog(DEBUG1, "magicplan - sampled query " UINT64_FORMAT " for a new search", fingerprint);
+			sampled = true;
+			history = &cached;
+		}
+		else
+		{
+			elog(DEBUG1, "magicplan - reused the cached decision for query " UINT64_FORMAT, fingerprint);
+			search_context.fenced = magicplan_feedback_choice(&cached) & search_context.scan.enabled;
+			magicplan_feedback_remember(parse->queryId, fingerprint, search_context.fenced);
+			apply_fences(&search_context, search_context.fenced);
+			magicplan_stats_record(fingerprint, true, false, 0, false, 0.0, 0.0, 0.0);
+			result = real_plan(&search_context);
+			magicplan_report_decision(MAGICPLAN_DECISION_CACHED, &search_context,
+									  search_context.fenced, 0.0, 0.0, 0.0);
+			return result;
+		}
+	}
+
+	/* The fences that did not change the cost at the last search will not
+	 * change it on a sampled search either, the relations and their
+	 * statistics being the same. After a change, a fence may matter again:
+	 * whether the planner keeps a sublink apart can depend on the costs */
+	if (sampled)
+		search_context.same_cost = history->same_cost & search_context.scan.enabled;
+
+	/* Query shapes that never benefit are planned as they are */
+	if (!sampled && !async_search && !pinned_search && magicplan_negative_skip(fingerprint))
 	{
-		return mutator_context.base_plan;
+		elog(DEBUG1, "magicplan - query " UINT64_FORMAT " never benefited, skipped the search", fingerprint);
+		magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+		result = real_plan(&search_context);
+		magicplan_report_decision(MAGICPLAN_DECISION_NEGATIVE, &search_context, 0,
+								  0.0, 0.0, 0.0);
+		return result;
 	}
-	best_cost = mutator_context.best_plan->planTree->total_cost;
 
-	if ((base_cost / best_cost) <= magicplan_threshold)
+	/* Custom plans are made again at each execution of a prepared statement,
+	 * they can leave the search to its generic plan or the other way round */
+	if (!async_search && !pinned_search && magicplan_prepared_plan_excluded(&search_context, history))
 	{
-		elog(DEBUG1, "magicplan - kept the pristine plan, pristine=%f vs 'optimized'=%f", base_cost, best_cost);
-		return mutator_context.base_plan;
+		elog(DEBUG1, "magicplan - %s plan of query " UINT64_FORMAT " excluded by magicplan.prepared_plans, skipped the search",
+			 boundParams == NULL ? "generic" : "custom", fingerprint);
+		/* A sampled decision is still good to use */
+		if (history && !history->stale)
+		{
+			search_context.fenced = magicplan_feedback_choice(history) & search_context.scan.enabled;
+			magicplan_feedback_remember(parse->queryId, fingerprint, search_context.fenced);
+			apply_fences(&search_context, search_context.fenced);
+		}
+		magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+		result = real_plan(&search_context);
+		magicplan_report_decision(MAGICPLAN_DECISION_PREPARED, &search_context,
+								  search_context.fenced, 0.0, 0.0, 0.0);
+		return result;
 	}
-	else
+
+	/* Queries run by functions can be planned a lot, only search them up to
+	 * magicplan.max_nesting_level. The level counts this planner call. */
+	if (!async_search && !pinned_search && magicplan_max_nesting_level >= 0 &&
+		magicplan_nesting_level - 1 > magicplan_max_nesting_level)
+	{
+		elog(DEBUG1, "magicplan - query " UINT64_FORMAT " is nested %d levels deep, skipped the search",
+			 fingerprint, magicplan_nesting_level - 1);
+		magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+		result = real_plan(&search_context);
+		magicplan_report_decision(MAGICPLAN_DECISION_NESTED, &search_context, 0,
+								  0.0, 0.0, 0.0);
+		return result;
+	}
+
+	/* Plan the original query for future reference */
+	INSTR_TIME_SET_CURRENT(start_time);
+	search_context.base_context = AllocSetContextCreate(CurrentMemoryContext,
+														"magicplan pristine plan",
+														ALLOCSET_DEFAULT_SIZES);
+	search_context.best_context = search_context.base_context;
+	search_context.peak_memory = 0;
+	oldcontext = MemoryContextSwitchTo(search_context.base_context);
+	search_context.current_query = copyObject(parse);
+	search_context.base_plan = real_plan(&search_context);
+	MemoryContextSwitchTo(oldcontext);
+	track_search_memory(&search_context, NULL);
+	base_cost = plan_goal_cost(&search_context, search_context.base_plan);
+	INSTR_TIME_SET_CURRENT(base_time);
+	search_context.search_start = base_time;
+	INSTR_TIME_SUBTRACT(base_time, start_time);
+	search_context.base_planning_time = INSTR_TIME_GET_MILLISEC(base_time);
+	magicplan_rank_sublinks(&search_context);
+
+	/* Queries searched before are weighed on what their searches brought,
+	 * the others on their cost */
+	adaptive = magicplan_adaptive &&
+		magicplan_adaptive_estimate(&search_context, fingerprint, base_cost, history,
+									&overhead, &savings);
+	/* A background search was already found worth it by the backend that
+	 * queued it, with its own settings */
+	if (!adaptive && !async_search && base_cost < magicplan_ignore_cost_below)
+	{
+		magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+		magicplan_report_decision(MAGICPLAN_DECISION_CHEAP, &search_context, 0,
+								  base_cost, base_cost, 0.0);
+		return search_context.base_plan;
+	}
+	if (adaptive && savings < overhead && !async_search && !pinned_search)
+	{
+		/* Search once in a while anyway, the data may have changed */
+		if (magicplan_adaptive_reprobe > 0 && magicplan_sample(magicplan_adaptive_reprobe))
+			elog(DEBUG1, "magicplan - reprobing query " UINT64_FORMAT " despite its expected savings", fingerprint);
+		else
+		{
+			elog(DEBUG1, "magicplan - expected savings of query " UINT64_FORMAT " below the search overhead, %f ms vs %f ms",
+				 fingerprint, savings, overhead);
+			magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+			magicplan_report_decision(MAGICPLAN_DECISION_ADAPTIVE, &search_context, 0,
+									  base_cost, base_cost, 0.0);
+			return search_context.base_plan;
+		}
+	}
+
+	/* Leave the search to a background worker if asked to, the next
+	 * executions will use its decision */
+	if (magicplan_async_search && !async_search && !pinned_search &&
+		magicplan_async_enqueue(&search_context, fingerprint))
+	{
+		magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+		magicplan_report_decision(MAGICPLAN_DECISION_QUEUED, &search_context, 0,
+								  base_cost, base_cost, 0.0);
+		return search_context.base_plan;
+	}
+
+	/* Only one backend searches a query at a time: the others planning it
+	 * meanwhile use the pristine plan, or the decision of that search if it
+	 * ends within magicplan.concurrent_search_wait_ms */
+	if (!async_search && !pinned_search)
+		flight = magicplan_flight_claim(fingerprint, &busy);
+	if (flight < 0 && busy)
+	{
+		if (magicplan_concurrent_search_wait > 0 &&
+			magicplan_flight_wait(fingerprint, magicplan_concurrent_search_wait) &&
+			magicplan_cache_lookup(fingerprint, &cached) && !cached.stale &&
+			cached.nsublinks == search_context.scan.nsublinks &&
+			magicplan_entry_signature(&search_context, &cached) == cached.signature)
+		{
+			elog(DEBUG1, "magicplan - reused the decision of the concurrent search of query " UINT64_FORMAT, fingerprint);
+			search_context.fenced = magicplan_feedback_choice(&cached) & search_context.scan.enabled;
+			magicplan_feedback_remember(parse->queryId, fingerprint, search_context.fenced);
+			magicplan_stats_record(fingerprint, true, false, 0, false, 0.0, 0.0, 0.0);
+			if (search_context.fenced == 0)
+				result = search_context.base_plan;
+			else
+			{
+				MemoryContextDelete(search_context.base_context);
+				search_context.current_query = parse;
+				apply_fences(&search_context, search_context.fenced);
+				result = real_plan(&search_context);
+			}
+			magicplan_report_decision(MAGICPLAN_DECISION_CACHED, &search_context,
+									  search_context.fenced, 0.0, 0.0, 0.0);
+			return result;
+		}
+		elog(DEBUG1, "magicplan - query " UINT64_FORMAT " is being searched by another backend, skipped the search", fingerprint);
+		magicplan_stats_record(fingerprint, false, false, 0, false, 0.0, 0.0, 0.0);
+		magicplan_report_decision(MAGICPLAN_DECISION_CONCURRENT, &search_context, 0,
+								  base_cost, base_cost, 0.0);
+		return search_context.base_plan;
+	}
+
+	/* The search slot must be released whatever fails until the decision is
+	 * stored, or the other backends would skip the query until this one
+	 * exits */
+	PG_TRY();
+	{
+		/* Try combinations of EXISTS(... OFFSET 0), as told by
+		 * magicplan.search_strategy */
+		if (magicplan_log_min_search_duration >= 0)
+			search_context.candidate_times = makeStringInfo();
+		magicplan_probe_search_start(fingerprint, search_context.nranked);
+		search_context.budget_exhausted = false;
+		search_context.best_plan = search_context.base_plan;
+		switch (magicplan_search_strategy)
+		{
+			case MAGICPLAN_SEARCH_EXHAUSTIVE:
+				search_exhaustive(&search_context);
+				break;
+			case MAGICPLAN_SEARCH_BEAM:
+				search_beam(&search_context);
+				break;
+			default:
+				search_greedy(&search_context);
+				break;
+		}
+		/* Leave the caller's query as it was given */
+		apply_fences(&search_context, 0);
+
+		/* If we found a better plan with OFFSET 0 sprinkled here and there
+		 * use that if the improvement in cost crosses the magicplan_threshold
+		 */
+		best_cost = plan_goal_cost(&search_context, search_context.best_plan);
+		threshold = magicplan_query_threshold(history);
+#if PG_VERSION_NUM >= 130000
+		elog(DEBUG1, "magicplan - peak memory during the search: %zu kB", search_context.peak_memory / 1024);
+#endif
+
+		/* Only the memory of the returned plan is kept */
+		if (search_context.fenced == 0 || (base_cost / best_cost) <= threshold)
+		{
+			elog(DEBUG1, "magicplan - kept the pristine plan, pristine=%f vs 'optimized'=%f", base_cost, best_cost);
+			if (search_context.best_context != search_context.base_context)
+				MemoryContextDelete(search_context.best_context);
+			/* Once in the negative cache, the query does not need to take room
+			 * in the decision cache, unless the feedback may still try the
+			 * fenced variant */
+			if (magicplan_negative_record(fingerprint, false) && !magicplan_feedback)
+				magicplan_cache_remove(fingerprint);
+			else
+				magicplan_cache_store(fingerprint, search_context.scan.nsublinks, 0, search_context.fenced,
+									  base_cost / best_cost, search_context.same_cost, custom_plan,
+									  search_context.base_plan->relationOids,
+									  magicplan_plan_signature(&search_context, search_context.base_plan->relationOids));
+			magicplan_feedback_remember(parse->queryId, fingerprint, 0);
+			result = search_context.base_plan;
+		}
+		else
+		{
+			elog(DEBUG1, "magicplan - injected an OFFSET 0, pristine=%f vs 'optimized'=%f", base_cost, best_cost);
+			MemoryContextDelete(search_context.base_context);
+			magicplan_negative_record(fingerprint, true);
+			magicplan_cache_store(fingerprint, search_context.scan.nsublinks, search_context.fenced, search_context.fenced,
+								  base_cost / best_cost, search_context.same_cost, custom_plan,
+								  search_context.best_plan->relationOids,
+								  magicplan_plan_signature(&search_context, search_context.best_plan->relationOids));
+			magicplan_feedback_remember(parse->queryId, fingerprint, search_context.fenced);
+			result = search_context.best_plan;
+		}
+	}
+	PG_CATCH();
 	{
-		elog(DEBUG1, "magicplan - injected an OFFSET 0, pristine=%f vs 'optimized'=%f", base_cost, best_cost);
-		return mutator_context.best_plan;
+		magicplan_flight_release(flight);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
+	/* The decision is published, the backends waiting for it can go on */
+	magicplan_flight_release(flight);
+
+	if (async_search)
+		magicplan_async_done = true;
+
+	INSTR_TIME_SET_CURRENT(end_time);
+	INSTR_TIME_SUBTRACT(end_time, search_context.search_start);
+	magicplan_probe_search_done(fingerprint, search_context.candidates,
+								result == search_context.base_plan ? 0 : search_context.fenced,
+								INSTR_TIME_GET_MILLISEC(end_time));
+	if (search_context.candidate_times &&
+		INSTR_TIME_GET_MILLISEC(end_time) >= magicplan_log_min_search_duration)
+		elog(LOG, "magicplan - search of query " UINT64_FORMAT " took %.3f ms, pristine plan: %.3f ms, %d candidates%s",
+			 fingerprint, INSTR_TIME_GET_MILLISEC(end_time), search_context.base_planning_time,
+			 search_context.candidates, search_context.candidate_times->data);
+	magicplan_stats_record(fingerprint, false, true, search_context.candidates,
+						   result != search_context.base_plan,
+						   INSTR_TIME_GET_MILLISEC(end_time),
+						   base_cost, plan_goal_cost(&search_context, result));
+	magicplan_report_decision(MAGICPLAN_DECISION_SEARCHED, &search_context,
+							  result == search_context.base_plan ? 0 : search_context.fenced,
+							  base_cost, plan_goal_cost(&search_context, result),
+							  INSTR_TIME_GET_MILLISEC(end_time));
+	return result;
 }